@@ -0,0 +1,160 @@
+#ifndef _BOUNDARY_H_
+#define _BOUNDARY_H_
+
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <vector>
+#include "const.h"
+#include "Point.h"
+
+// container walls as closed polygons inside the unit square, baked into a
+// signed distance field (negative in the fluid) with its gradient, so that
+// any geometry costs one bilinear lookup per particle
+class Container
+{
+private:
+	int res;
+	float cell;
+	std::vector<float> phi;
+	std::vector<Point2f> grad;
+
+	static Point2f closestOnSegment(const Point2f &p, const Point2f &a, const Point2f &b)
+	{
+		Point2f ab = b - a, ap = p - a;
+		float t = ab.LengthSquared() > 0.0f ? (ap.x * ab.x + ap.y * ab.y) / ab.LengthSquared() : 0.0f;
+		if (t < 0.0f) t = 0.0f;
+		else if (t > 1.0f) t = 1.0f;
+		return a + t * ab;
+	}
+
+	//even-odd rule over all loops, so inner loops cut obstacles out
+	bool inside(const Point2f &p)
+	{
+		int i, j, k, n;
+		bool in = false;
+
+		for (k = 0; k < (int)loops.size(); k++) {
+			const std::vector<Point2f> &l = loops[k];
+			n = (int)l.size();
+			for (i = 0, j = n - 1; i < n; j = i++) {
+				if ((l[i].y > p.y) != (l[j].y > p.y) &&
+					p.x < (l[j].x - l[i].x) * (p.y - l[i].y) / (l[j].y - l[i].y) + l[i].x)
+					in = !in;
+			}
+		}
+		return in;
+	}
+
+public:
+	std::vector<std::vector<Point2f> > loops;
+
+	Container()
+	{
+		res = 0;
+		cell = 1.0f;
+		box();
+	}
+
+	//the old hard-coded tank
+	void box(void)
+	{
+		loops.assign(1, std::vector<Point2f>());
+		loops[0].push_back(Point2f(0.0f, 0.0f));
+		loops[0].push_back(Point2f(1.0f, 0.0f));
+		loops[0].push_back(Point2f(1.0f, 1.0f));
+		loops[0].push_back(Point2f(0.0f, 1.0f));
+	}
+
+	// one "x y" vertex per line, a blank line closes the current loop
+	bool load(const char *fileName)
+	{
+		char line[256];
+		float x, y;
+		std::vector<std::vector<Point2f> > l(1);
+		FILE *fp = fopen(fileName, "rt");
+
+		if (!fp) return false;
+		while (fgets(line, 256, fp)) {
+			if (line[0] == '#') continue;
+			if (sscanf(line, "%f %f", &x, &y) == 2)
+				l.back().push_back(Point2f(x, y));
+			else if (!l.back().empty())
+				l.push_back(std::vector<Point2f>());
+		}
+		fclose(fp);
+		if (l.back().size() < 3) l.pop_back();
+		if (l.empty()) return false;
+		loops = l;
+		return true;
+	}
+
+	// samples sit at cell centres, so none falls on the walls of the unit
+	// square where the normal would be undefined; the normal comes from the
+	// closest wall point rather than from differencing the field
+	void bake(int resolution)
+	{
+		int i, j, k, m, n;
+		float d2, d;
+		Point2f p, c, cMin;
+
+		res = resolution;
+		cell = 1.0f / res;
+		phi.resize(res * res);
+		grad.resize(res * res);
+
+#pragma omp parallel for private(i, k, m, n, d2, d, p, c, cMin)
+		for (j = 0; j < res; j++) {
+			for (i = 0; i < res; i++) {
+				p.Set((i + 0.5f) * cell, (j + 0.5f) * cell);
+				d2 = FLT_MAX;
+				cMin.Set(FLT_MAX, FLT_MAX);
+				for (k = 0; k < (int)loops.size(); k++) {
+					n = (int)loops[k].size();
+					for (m = 0; m < n; m++) {
+						c = closestOnSegment(p, loops[k][m], loops[k][(m + 1) % n]);
+						d = (p - c).LengthSquared();
+						if (d < d2) {
+							d2 = d;
+							cMin = c;
+						}
+					}
+				}
+				d = sqrt(d2);
+				//a sample right on a wall gets its normal from its neighbours
+				grad[i + j * res] = d > 0.0f ? (p - cMin) / d : Point2f(0.0f, 0.0f);
+				phi[i + j * res] = d;
+				if (inside(p)) {
+					phi[i + j * res] = -d;
+					grad[i + j * res] = -grad[i + j * res];
+				}
+			}
+		}
+	}
+
+	// signed distance and outward normal at pos, which must lie in the unit
+	// square; half a cell from the edges the field is extrapolated linearly
+	inline float sample(const Point2f &pos, Point2f &normal)
+	{
+		float fx = pos.x / cell - 0.5f, fy = pos.y / cell - 0.5f;
+		int i = (int)fx, j = (int)fy;
+		if (i > res - 2) i = res - 2;
+		if (j > res - 2) j = res - 2;
+		float a = fx - i, b = fy - j;
+		int k = i + j * res;
+		float w00 = (1 - a) * (1 - b), w10 = a * (1 - b), w01 = (1 - a) * b, w11 = a * b;
+		float d = w00 * phi[k] + w10 * phi[k + 1] + w01 * phi[k + res] + w11 * phi[k + res + 1];
+
+		//normals are interpolated, never extrapolated
+		a = a < 0.0f ? 0.0f : (a > 1.0f ? 1.0f : a);
+		b = b < 0.0f ? 0.0f : (b > 1.0f ? 1.0f : b);
+		w00 = (1 - a) * (1 - b);
+		w10 = a * (1 - b);
+		w01 = (1 - a) * b;
+		w11 = a * b;
+		normal = w00 * grad[k] + w10 * grad[k + 1] + w01 * grad[k + res] + w11 * grad[k + res + 1];
+		return d;
+	}
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef _BOUNDARY_PARTICLES_H_
+#define _BOUNDARY_PARTICLES_H_
+
+#include <vector>
+#include "const.h"
+#include "Point.h"
+#include "Boundary.h"
+
+// static particles filling the walls of a container up to one kernel radius
+// deep. They are sorted by cell once and never move, so their summed kernel
+// contributions are baked into a field that the solver reads with one
+// bilinear lookup per fluid particle instead of walking them every step.
+class BoundaryParticles
+{
+private:
+	//table over [-kr, 1 + kr], one kernel radius per cell
+	int tLen;
+	float cell, lo;
+	int fRes;
+	float fCell;
+	std::vector<float> dens, lap;
+	std::vector<Point2f> grad;
+
+	int cellOf(float v)
+	{
+		int c = (int)((v - lo) / cell);
+		if (c < 0) c = 0;
+		if (c > tLen - 1) c = tLen - 1;
+		return c;
+	}
+
+public:
+	std::vector<Point2f> pos;
+	std::vector<int> cellStart;
+
+	BoundaryParticles()
+	{
+		tLen = 0;
+		cell = 1.0f;
+		lo = 0.0f;
+		fRes = 0;
+		fCell = 1.0f;
+	}
+
+	int count(void)
+	{
+		return (int)pos.size();
+	}
+
+	// lattice points of the given spacing lying outside the fluid but within
+	// kr of it, counting sorted into the cell table
+	void sample(Container &c, float spacing, float kr)
+	{
+		int i, j, n, index;
+		float d;
+		Point2f p, q, normal;
+		std::vector<Point2f> raw;
+		std::vector<int> key;
+
+		cell = kr;
+		lo = -kr;
+		tLen = (int)((1.0f + 2.0f * kr) / cell) + 1;
+
+		n = (int)((1.0f + 2.0f * kr) / spacing) + 1;
+		for (j = 0; j < n; j++) {
+			for (i = 0; i < n; i++) {
+				p.Set(lo + (i + 0.5f) * spacing, lo + (j + 0.5f) * spacing);
+				//outside the unit square add the distance to it
+				q.Set(p.x < 0.0f ? 0.0f : (p.x > 1.0f ? 1.0f : p.x), p.y < 0.0f ? 0.0f : (p.y > 1.0f ? 1.0f : p.y));
+				d = c.sample(q, normal) + (p - q).Length();
+				if (d <= 0.0f || d > kr) continue;
+				raw.push_back(p);
+				key.push_back(cellOf(p.x) + cellOf(p.y) * tLen);
+			}
+		}
+
+		cellStart.assign(tLen * tLen + 1, 0);
+		for (i = 0; i < (int)raw.size(); i++) cellStart[key[i] + 1]++;
+		for (i = 0; i < tLen * tLen; i++) cellStart[i + 1] += cellStart[i];
+		pos.resize(raw.size());
+		std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+		for (i = 0; i < (int)raw.size(); i++) {
+			index = fill[key[i]]++;
+			pos[index] = raw[i];
+		}
+	}
+
+	// sums of w, g and l over the boundary particles near x
+	template <class W, class G, class L>
+	void gather(const Point2f &x, W &w, G &g, L &l, float &densSum, Point2f &gradSum, float &lapSum)
+	{
+		int j, k, x0, y0, cx, cy, index;
+		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
+		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+		Point2f r;
+
+		densSum = lapSum = 0.0f;
+		gradSum.Zero();
+		x0 = cellOf(x.x);
+		y0 = cellOf(x.y);
+		for (j = 0; j < 9; j++) {
+			cx = x0 + dx[j];
+			cy = y0 + dy[j];
+			if (cx < 0 || cx > tLen - 1 || cy < 0 || cy > tLen - 1) continue;
+			index = cx + cy * tLen;
+			for (k = cellStart[index]; k < cellStart[index + 1]; k++) {
+				r = x - pos[k];
+				densSum += w(r);
+				gradSum += g(r);
+				lapSum += l(r);
+			}
+		}
+	}
+
+	// kernel sums at the nodes of a res x res field over the unit square
+	template <class W, class G, class L>
+	void bake(int res, W w, G g, L l)
+	{
+		int i, j;
+
+		fRes = res;
+		fCell = 1.0f / (res - 1);
+		dens.resize(res * res);
+		grad.resize(res * res);
+		lap.resize(res * res);
+#pragma omp parallel for private(i)
+		for (j = 0; j < res; j++)
+			for (i = 0; i < res; i++)
+				gather(Point2f(i * fCell, j * fCell), w, g, l, dens[i + j * res], grad[i + j * res], lap[i + j * res]);
+	}
+
+	// baked density and gradient sums at x, which must lie in the unit square
+	inline float field(const Point2f &x, Point2f &g)
+	{
+		float fx = x.x / fCell, fy = x.y / fCell;
+		int i = (int)fx, j = (int)fy;
+		if (i > fRes - 2) i = fRes - 2;
+		if (j > fRes - 2) j = fRes - 2;
+		float a = fx - i, b = fy - j;
+		int k = i + j * fRes;
+		float w00 = (1 - a) * (1 - b), w10 = a * (1 - b), w01 = (1 - a) * b, w11 = a * b;
+
+		g = w00 * grad[k] + w10 * grad[k + 1] + w01 * grad[k + fRes] + w11 * grad[k + fRes + 1];
+		return w00 * dens[k] + w10 * dens[k + 1] + w01 * dens[k + fRes] + w11 * dens[k + fRes + 1];
+	}
+
+	// baked Laplacian kernel sum at x, for conduction into the walls
+	inline float laplacian(const Point2f &x)
+	{
+		float fx = x.x / fCell, fy = x.y / fCell;
+		int i = (int)fx, j = (int)fy;
+		if (i > fRes - 2) i = fRes - 2;
+		if (j > fRes - 2) j = fRes - 2;
+		float a = fx - i, b = fy - j;
+		int k = i + j * fRes;
+
+		return (1 - a) * (1 - b) * lap[k] + a * (1 - b) * lap[k + 1] + (1 - a) * b * lap[k + fRes] + a * b * lap[k + fRes + 1];
+	}
+};
+
+#endif
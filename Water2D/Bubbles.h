@@ -0,0 +1,171 @@
+#ifndef _BUBBLES_H_
+#define _BUBBLES_H_
+
+#include <math.h>
+#include <vector>
+#include "const.h"
+#include "Point.h"
+
+struct Bubble {
+	Point2f pos, vel;
+	float volume;
+	//set by the solver when the bubble touches ice
+	bool trapped;
+	int next;
+};
+
+// bubbles released from dissolved air, kept apart from the SPH particles so
+// that merging and buoyancy only cost time proportional to the bubble count
+class BubbleSystem
+{
+private:
+	int hLen;
+	float hCell;
+	std::vector<int> head;
+
+	void buildHash(void)
+	{
+		int i, x, y, index;
+		float rMax = 0.0f;
+
+		for (i = 0; i < (int)b.size(); i++)
+			if (radius(b[i].volume) > rMax) rMax = radius(b[i].volume);
+		//merging looks one cell around, so a cell must hold the largest pair
+		hCell = 2.0f * rMax;
+		if (hCell < 1.0f / BUBBLE_HASH_MAX) hCell = 1.0f / BUBBLE_HASH_MAX;
+		hLen = (int)(1.0f / hCell) + 1;
+		head.assign(hLen * hLen, -1);
+		for (i = 0; i < (int)b.size(); i++) {
+			x = cellOf(b[i].pos.x);
+			y = cellOf(b[i].pos.y);
+			index = x + y * hLen;
+			b[i].next = head[index];
+			head[index] = i;
+		}
+	}
+
+	int cellOf(float v)
+	{
+		int c = (int)(v / hCell);
+		if (c < 0) c = 0;
+		if (c > hLen - 1) c = hLen - 1;
+		return c;
+	}
+
+	void merge(void)
+	{
+		int i, j, k, x0, y0, x, y;
+		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
+		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+		float v;
+		Point2f r;
+
+		buildHash();
+		for (i = 0; i < (int)b.size(); i++) {
+			if (b[i].volume <= 0.0f) continue;
+			x0 = cellOf(b[i].pos.x);
+			y0 = cellOf(b[i].pos.y);
+			for (k = 0; k < 9; k++) {
+				x = x0 + dx[k];
+				y = y0 + dy[k];
+				if (x < 0 || x > hLen - 1 || y < 0 || y > hLen - 1) continue;
+				for (j = head[x + y * hLen]; j != -1; j = b[j].next) {
+					if (j <= i || b[j].volume <= 0.0f) continue;
+					r = b[i].pos - b[j].pos;
+					if (r.LengthSquared() > SQ(radius(b[i].volume) + radius(b[j].volume))) continue;
+					//volume weighted, so a small bubble joins a big one in place
+					v = b[i].volume + b[j].volume;
+					b[i].pos = (b[i].volume * b[i].pos + b[j].volume * b[j].pos) / v;
+					b[i].vel = (b[i].volume * b[i].vel + b[j].volume * b[j].vel) / v;
+					b[i].trapped = b[i].trapped || b[j].trapped;
+					b[i].volume = v;
+					b[j].volume = 0.0f;
+				}
+			}
+		}
+	}
+
+	void compact(void)
+	{
+		int i, n = 0;
+
+		for (i = 0; i < (int)b.size(); i++)
+			if (b[i].volume > 0.0f) b[n++] = b[i];
+		b.resize(n);
+	}
+
+public:
+	std::vector<Bubble> b;
+	//x, y, radius per bubble, ready for the renderer
+	std::vector<float> instance;
+	//air let out by bubbles bursting or leaving the top, since the start
+	double released;
+
+	BubbleSystem()
+	{
+		hLen = 0;
+		hCell = 1.0f;
+		released = 0.0;
+	}
+
+	static float radius(float volume)
+	{
+		return BUBBLE_RADIUS * sqrt(volume);
+	}
+
+	int count(void)
+	{
+		return (int)b.size();
+	}
+
+	void add(const Point2f &pos, const Point2f &vel, float volume)
+	{
+		Bubble n;
+
+		n.pos = pos;
+		n.vel = vel;
+		n.volume = volume;
+		n.trapped = false;
+		n.next = -1;
+		b.push_back(n);
+	}
+
+	//bubbles flagged by the solver as out of the water burst
+	void burst(int i)
+	{
+		released += b[i].volume;
+		b[i].volume = 0.0f;
+	}
+
+	void update(float h)
+	{
+		int i;
+
+		for (i = 0; i < (int)b.size(); i++) {
+			if (b[i].volume <= 0.0f) continue;
+			if (b[i].trapped) {
+				b[i].vel.Zero();
+				continue;
+			}
+			b[i].vel.y += BUBBLE_BUOYANCY * h;
+			b[i].vel *= BUBBLE_DRAG;
+			b[i].pos += b[i].vel * h;
+			if (b[i].pos.x < 0.0f) b[i].pos.x = 0.0f;
+			else if (b[i].pos.x > 1.0f) b[i].pos.x = 1.0f;
+			if (b[i].pos.y < 0.0f) b[i].pos.y = 0.0f;
+			else if (b[i].pos.y >= 1.0f) burst(i);
+		}
+
+		merge();
+		compact();
+
+		instance.resize(3 * b.size());
+		for (i = 0; i < (int)b.size(); i++) {
+			instance[3 * i + 0] = b[i].pos.x;
+			instance[3 * i + 1] = b[i].pos.y;
+			instance[3 * i + 2] = radius(b[i].volume);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef _DOMAIN_H_
+#define _DOMAIN_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <omp.h>
+#include "SPH.h"
+#include "Transport.h"
+
+// one vertical slab [x0, x1) of a distributed run. Each step particles and
+// bubbles that crossed into a neighbour's slab migrate there, particles
+// within KR of a slab edge are copied to the neighbour as ghosts, and after
+// the density pass the ghosts get their neighbour's density and pressure.
+// The heat grid is splatted from the particles of all ranks, so every rank
+// steps the same whole grid. Bubbles either side of an edge only merge once
+// one has crossed it. Every few steps adjacent ranks move their shared edge
+// to even out particle counts.
+class SlabDomain : public GridReducer
+{
+private:
+	struct Load
+	{
+		int n;
+		float lo, hi;
+	};
+
+	Transport *net;
+	SPH *s;
+	int left, right, gLeft;
+	std::vector<int> sentLeft, sentRight;
+	std::vector<Particle> outLeft, outRight;
+	std::vector<Bubble> bubblesLeft, bubblesRight;
+	std::vector<char> msg;
+
+	void lost(int peer)
+	{
+		fprintf(stderr, "rank %d: lost rank %d\n", net->rank, peer);
+		exit(-1);
+	}
+
+	// on each link the lower rank sends first; every rank serves its left
+	// link before its right one, so blocking transports cannot deadlock
+	void exchange(int peer, const void *data, int bytes, std::vector<char> &reply)
+	{
+		bool ok;
+
+		if (peer < net->rank)
+			ok = net->recv(peer, reply) && net->send(peer, data, bytes);
+		else
+			ok = net->send(peer, data, bytes) && net->recv(peer, reply);
+		if (!ok) lost(peer);
+	}
+
+	// v summed over every rank and handed back to all: partial sums travel
+	// right along the chain and the last rank's total comes back left, so
+	// every rank gets the same bits
+	void allReduce(float *v, int n)
+	{
+		int i;
+		const float *f;
+
+		if (left >= 0) {
+			if (!net->recv(left, msg) || (int)msg.size() != n * (int)sizeof(float)) lost(left);
+			f = (const float *)&msg[0];
+			for (i = 0; i < n; i++) v[i] += f[i];
+		}
+		if (right >= 0) {
+			if (!net->send(right, v, n * sizeof(float)) || !net->recv(right, msg) ||
+				(int)msg.size() != n * (int)sizeof(float)) lost(right);
+			memcpy(v, &msg[0], n * sizeof(float));
+		}
+		if (left >= 0 && !net->send(left, v, n * sizeof(float))) lost(left);
+	}
+
+	static const void *bytesOf(const std::vector<Particle> &v)
+	{
+		return v.empty() ? NULL : &v[0];
+	}
+
+	void receiveOwned(const std::vector<char> &m)
+	{
+		int i, n = (int)(m.size() / sizeof(Particle));
+
+		if (s->pNum + n > s->param.maxParticles) {
+			fprintf(stderr, "rank %d: particle capacity exceeded\n", net->rank);
+			exit(-1);
+		}
+		for (i = 0; i < n; i++) s->p[s->pNum + i] = ((const Particle *)&m[0])[i];
+		s->pNum += n;
+	}
+
+	void receiveGhosts(const std::vector<char> &m)
+	{
+		int i, n = (int)(m.size() / sizeof(Particle));
+
+		if (s->gNum + n > s->param.maxGhosts) {
+			fprintf(stderr, "rank %d: ghost capacity exceeded\n", net->rank);
+			exit(-1);
+		}
+		for (i = 0; i < n; i++) s->p[s->pNum + s->gNum + i] = ((const Particle *)&m[0])[i];
+		s->gNum += n;
+	}
+
+	void receiveBubbles(const std::vector<char> &m)
+	{
+		int i, n = (int)(m.size() / sizeof(Bubble));
+
+		for (i = 0; i < n; i++) s->bubbles.b.push_back(((const Bubble *)&m[0])[i]);
+	}
+
+	void migrate(void)
+	{
+		int i;
+		std::vector<Bubble> &b = s->bubbles.b;
+
+		outLeft.clear();
+		outRight.clear();
+		for (i = s->pNum - 1; i >= 0; i--) {
+			if (left >= 0 && s->p[i].pos.x < x0) outLeft.push_back(s->p[i]);
+			else if (right >= 0 && s->p[i].pos.x >= x1) outRight.push_back(s->p[i]);
+			else continue;
+			s->p[i] = s->p[--s->pNum];
+		}
+		bubblesLeft.clear();
+		bubblesRight.clear();
+		for (i = (int)b.size() - 1; i >= 0; i--) {
+			if (left >= 0 && b[i].pos.x < x0) bubblesLeft.push_back(b[i]);
+			else if (right >= 0 && b[i].pos.x >= x1) bubblesRight.push_back(b[i]);
+			else continue;
+			b[i] = b.back();
+			b.pop_back();
+		}
+		if (left >= 0) {
+			exchange(left, bytesOf(outLeft), (int)(outLeft.size() * sizeof(Particle)), msg);
+			receiveOwned(msg);
+			exchange(left, bubblesLeft.empty() ? NULL : &bubblesLeft[0], (int)(bubblesLeft.size() * sizeof(Bubble)), msg);
+			receiveBubbles(msg);
+		}
+		if (right >= 0) {
+			exchange(right, bytesOf(outRight), (int)(outRight.size() * sizeof(Particle)), msg);
+			receiveOwned(msg);
+			exchange(right, bubblesRight.empty() ? NULL : &bubblesRight[0], (int)(bubblesRight.size() * sizeof(Bubble)), msg);
+			receiveBubbles(msg);
+		}
+	}
+
+	void sendGhosts(void)
+	{
+		int i;
+		float kr = s->param.kr;
+
+		sentLeft.clear();
+		sentRight.clear();
+		outLeft.clear();
+		outRight.clear();
+		for (i = 0; i < s->pNum; i++) {
+			if (left >= 0 && s->p[i].pos.x < x0 + kr) {
+				sentLeft.push_back(i);
+				outLeft.push_back(s->p[i]);
+			}
+			if (right >= 0 && s->p[i].pos.x >= x1 - kr) {
+				sentRight.push_back(i);
+				outRight.push_back(s->p[i]);
+			}
+		}
+		s->gNum = 0;
+		gLeft = 0;
+		if (left >= 0) {
+			exchange(left, bytesOf(outLeft), (int)(outLeft.size() * sizeof(Particle)), msg);
+			receiveGhosts(msg);
+			gLeft = s->gNum;
+		}
+		if (right >= 0) {
+			exchange(right, bytesOf(outRight), (int)(outRight.size() * sizeof(Particle)), msg);
+			receiveGhosts(msg);
+		}
+	}
+
+	//density and pressure of the ghosts, in the order they were sent
+	void refresh(int peer, const std::vector<int> &sent, int first, int n)
+	{
+		int i;
+		std::vector<float> v(2 * sent.size());
+
+		for (i = 0; i < (int)sent.size(); i++) {
+			v[2 * i] = s->p[sent[i]].dens;
+			v[2 * i + 1] = s->p[sent[i]].pressure;
+		}
+		exchange(peer, v.empty() ? NULL : &v[0], (int)(v.size() * sizeof(float)), msg);
+		const float *f = msg.empty() ? NULL : (const float *)&msg[0];
+		for (i = 0; i < n && 2 * i + 1 < (int)(msg.size() / sizeof(float)); i++) {
+			s->p[first + i].dens = f[2 * i];
+			s->p[first + i].pressure = f[2 * i + 1];
+		}
+	}
+
+	void refreshGhosts(void)
+	{
+		if (left >= 0) refresh(left, sentLeft, s->pNum, gLeft);
+		if (right >= 0) refresh(right, sentRight, s->pNum + gLeft, s->gNum - gLeft);
+	}
+
+	// new shared edge of two adjacent slabs, assuming particles spread evenly
+	// within each; both ranks compute it from the same numbers
+	float split(const Load &a, const Load &b)
+	{
+		float kr = s->param.kr, edge = a.hi, half, e;
+
+		if (a.n + b.n == 0) return edge;
+		half = 0.5f * (a.n + b.n);
+		if (half <= a.n)
+			e = a.lo + half / a.n * (a.hi - a.lo);
+		else
+			e = b.lo + (half - a.n) / b.n * (b.hi - b.lo);
+		//move half way, and keep both slabs at least a ghost layer wide
+		e = edge + 0.5f * (e - edge);
+		if (e < a.lo + kr) e = a.lo + kr;
+		if (e > b.hi - kr) e = b.hi - kr;
+		return e;
+	}
+
+	void rebalance(void)
+	{
+		Load own, other;
+
+		if (left >= 0) {
+			own.n = s->pNum;
+			own.lo = x0;
+			own.hi = x1;
+			exchange(left, &own, sizeof(Load), msg);
+			memcpy(&other, &msg[0], sizeof(Load));
+			x0 = split(other, own);
+		}
+		if (right >= 0) {
+			own.n = s->pNum;
+			own.lo = x0;
+			own.hi = x1;
+			exchange(right, &own, sizeof(Load), msg);
+			memcpy(&other, &msg[0], sizeof(Load));
+			x1 = split(own, other);
+		}
+	}
+
+public:
+	float x0, x1;
+
+	SlabDomain(Transport *transport, SPH *sph)
+	{
+		net = transport;
+		s = sph;
+		left = net->rank > 0 ? net->rank - 1 : -1;
+		right = net->rank < net->ranks - 1 ? net->rank + 1 : -1;
+		x0 = (float)net->rank / net->ranks;
+		x1 = (float)(net->rank + 1) / net->ranks;
+		gLeft = 0;
+		s->gridReducer = this;
+	}
+
+	~SlabDomain()
+	{
+		s->gridReducer = NULL;
+	}
+
+	void sum(float *v, int n)
+	{
+		allReduce(v, n);
+	}
+
+	void step(void)
+	{
+		s->removeKilled();
+		migrate();
+		s->sortParticles();
+		sendGhosts();
+		s->updateDensity();
+		refreshGhosts();
+		s->updateMotion();
+		s->gNum = 0;
+	}
+
+	// total particles are emitted by the rank whose slab holds the source
+	void run(int steps, int freezeStep, int total, FILE *out)
+	{
+		int k, n, emitted = 0;
+		bool emitter = s->source().x >= x0 && s->source().x < x1;
+		double t0 = omp_get_wtime();
+
+		for (k = 0; k < steps; k++) {
+			if (emitter && emitted < total) {
+				n = s->pNum;
+				s->generateParticle();
+				emitted += s->pNum - n;
+			}
+			if (k == freezeStep) s->freeze = true;
+			step();
+			if (k % DOMAIN_REBALANCE == 0) rebalance();
+		}
+
+		fprintf(out, "rank %d slab [%f, %f) particles %d ice_fraction %f total_air %f bubbles %d max_speed %f seconds %.2f\n",
+			net->rank, x0, x1, s->pNum, s->stats.iceFraction, s->stats.totalAir, s->bubbles.count(), s->stats.maxSpeed,
+			omp_get_wtime() - t0);
+		fflush(out);
+	}
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _EMITTER_H_
+#define _EMITTER_H_
+
+#include <math.h>
+#include "const.h"
+#include "Point.h"
+
+enum EmitShape { EMIT_RING, EMIT_LINE, EMIT_DISK };
+
+// a source of particles. Every step rate more particles fall due, and they
+// are spawned batch at a time, laid out in the shape around pos and all
+// moving at vel
+struct Emitter
+{
+	int shape;
+	Point2f pos, vel;
+	//radius of a ring or disk, half the length of a line
+	float size;
+	float rate;
+	int batch;
+	//due but not yet spawned
+	float due;
+
+	Emitter()
+	{
+		shape = EMIT_RING;
+		pos.Set(0.2f, 0.8f);
+		vel.Set(0.8f, 0.6f);
+		size = 0.015625f;
+		rate = 4.0f;
+		batch = 4;
+		due = 0.0f;
+	}
+
+	// batches falling due this step
+	int batches(void)
+	{
+		int n;
+
+		if (batch < 1) return 0;
+		due += rate;
+		n = (int)(due / batch);
+		due -= (float)(n * batch);
+		return n;
+	}
+
+	// where particle i of a batch starts
+	Point2f place(int i)
+	{
+		float t, d;
+		Point2f across;
+
+		switch (shape) {
+		case EMIT_LINE:
+			//across the direction of travel, ends included
+			d = vel.Length();
+			across = d > EPS ? Point2f(-vel.y / d, vel.x / d) : Point2f(1.0f, 0.0f);
+			t = batch > 1 ? 2.0f * i / (batch - 1) - 1.0f : 0.0f;
+			return pos + (size * t) * across;
+		case EMIT_DISK:
+			//sunflower spiral, evenly spread for any batch size
+			t = size * sqrt((i + 0.5f) / batch);
+			d = i * GOLDEN_ANGLE;
+			return pos + t * Point2f(cos(d), sin(d));
+		default:
+			return pos + size * Point2f(cos((float)i / batch * D360), sin((float)i / batch * D360));
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef _ENSEMBLE_H_
+#define _ENSEMBLE_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include "SPH.h"
+#include "Params.h"
+#include "SoftRender.h"
+
+// many independent SPH runs spread over the cores, one instance per worker.
+// The run file holds "key value" lines: steps and freeze (step at which
+// freezing starts, -1 for never) apply to every run, parameters before the
+// first "name" line are the base of all runs, and each "name" line starts a
+// run that overrides the base with the parameters following it. Every run
+// is in container unless a "container" line names a wall file for the base
+// or for one run. With a thumbnail directory each run's last frame is also
+// drawn to <name>.bmp.
+class Ensemble
+{
+private:
+	struct Run
+	{
+		std::string name;
+		SimParams param;
+		Container walls;
+	};
+
+	std::vector<Run> runs;
+	int steps, freezeStep;
+
+public:
+	std::string thumbs;
+	int thumbMode;
+	//walls of the runs that name none, the unit box unless set before load
+	Container container;
+
+	Ensemble()
+	{
+		steps = 1000;
+		freezeStep = -1;
+		thumbMode = 0;
+	}
+
+	bool load(const char *fileName)
+	{
+		char line[256], key[128], value[128];
+		SimParams base;
+		Container baseWalls = container;
+		FILE *fp = fopen(fileName, "rt");
+
+		if (!fp) return false;
+		while (fgets(line, 256, fp)) {
+			if (sscanf(line, "%127s %127s", key, value) != 2 || key[0] == '#') continue;
+			if (strcmp(key, "steps") == 0) steps = atoi(value);
+			else if (strcmp(key, "freeze") == 0) freezeStep = atoi(value);
+			else if (strcmp(key, "name") == 0) {
+				Run r;
+				r.name = value;
+				r.param = base;
+				r.walls = baseWalls;
+				runs.push_back(r);
+			}
+			else if (strcmp(key, "container") == 0) {
+				if (!(runs.empty() ? baseWalls.load(value) : runs.back().walls.load(value)))
+					fprintf(stderr, "%s: cannot read %s\n", fileName, value);
+			}
+			else if (!(runs.empty() ? base.set(key, value) : runs.back().param.set(key, value)))
+				fprintf(stderr, "%s: unknown parameter %s\n", fileName, key);
+		}
+		fclose(fp);
+		return true;
+	}
+
+	// one summary line per run, written as soon as the run finishes
+	void run(FILE *out)
+	{
+		int i, k;
+
+		fprintf(out, "# run steps particles ice_fraction total_air max_speed bubbles seconds\n");
+		fflush(out);
+
+#pragma omp parallel for private(k) schedule(dynamic, 1)
+		for (i = 0; i < (int)runs.size(); i++) {
+			double t0 = omp_get_wtime();
+			SPH *s = new SPH;
+
+			s->param = runs[i].param;
+			s->boundary = runs[i].walls;
+			s->init(32);
+			for (k = 0; k < steps; k++) {
+				if (s->pNum < s->param.maxParticles) s->generateParticle();
+				if (k == freezeStep) s->freeze = true;
+				s->update();
+			}
+			if (!thumbs.empty()) {
+				SoftRenderer r;
+				r.resize(SOFT_SIZE / 4, SOFT_SIZE / 4);
+				r.render(*s, thumbMode);
+				r.save((thumbs + "/" + runs[i].name + ".bmp").c_str());
+			}
+
+#pragma omp critical
+			{
+				fprintf(out, "%s %d %d %f %f %f %d %.2f\n", runs[i].name.c_str(), steps, s->pNum,
+					s->stats.iceFraction, s->stats.totalAir, s->stats.maxSpeed, s->bubbles.count(), omp_get_wtime() - t0);
+				fflush(out);
+			}
+			delete s;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef _EVENT_LOG_H_
+#define _EVENT_LOG_H_
+
+#include <stdio.h>
+#include <vector>
+#include "const.h"
+#include "Point.h"
+#include "Thread.h"
+
+#define EVENT_MAGIC 0x57443245
+#define EVENT_VERSION 2
+
+enum EventKind { PHASE_CHANGE, AIR_RELEASE };
+
+// one event of a particle: the step, its ID, its phases before and after,
+// its temperature, dissolved air and position at the time. A water particle
+// releasing its air logs water to bubble, with the air it gave and the
+// index the new bubble has in the bubble system that step; other events
+// have no bubble, -1.
+struct PhaseEvent
+{
+	int step;
+	unsigned int id;
+	unsigned char kind, from, to, pad;
+	float T, S;
+	float x, y;
+	int bubble;
+};
+
+struct EventHeader
+{
+	unsigned int magic, version, eventBytes;
+};
+
+// phase changes logged from any thread into a ring of its own, and written
+// to a binary file by a background thread: the header, then the events,
+// in step order per thread but not across threads. Each ring has one
+// writer, its thread, and one reader, the background thread, so logging
+// takes no lock: the event is stored, then the head moves past it. A full
+// ring drops the event and counts it rather than hold up the solver.
+class EventLog
+{
+private:
+	struct Ring
+	{
+		PhaseEvent e[EVENT_RING];
+		volatile long head, tail;
+	};
+
+	Ring *rings;
+	FILE *fp;
+	Thread writer;
+	volatile long quit;
+
+	static void entry(void *l)
+	{
+		((EventLog *)l)->loop();
+	}
+
+	void loop(void)
+	{
+		while (!quit) {
+			drain();
+			sleepMs(EVENT_FLUSH_MS);
+		}
+		drain();
+	}
+
+	void drain(void)
+	{
+		int k;
+		long h, t, n;
+
+		for (k = 0; k < EVENT_RINGS; k++) {
+			Ring &r = rings[k];
+			h = r.head;
+			memoryFence();
+			for (t = r.tail; t != h; t += n) {
+				//up to the end of the ring at most, then from its start
+				n = EVENT_RING - (t & (EVENT_RING - 1));
+				if (n > h - t) n = h - t;
+				fwrite(&r.e[t & (EVENT_RING - 1)], sizeof(PhaseEvent), n, fp);
+			}
+			written += h - r.tail;
+			memoryFence();
+			r.tail = h;
+		}
+		fflush(fp);
+	}
+
+public:
+	volatile long dropped;
+	long written;
+
+	EventLog()
+	{
+		rings = NULL;
+		fp = NULL;
+		quit = 0;
+		dropped = 0;
+		written = 0;
+	}
+
+	~EventLog()
+	{
+		close();
+	}
+
+	bool open(const char *fileName)
+	{
+		int k;
+		EventHeader header;
+
+		close();
+		fp = fopen(fileName, "wb");
+		if (fp == NULL) return false;
+		header.magic = EVENT_MAGIC;
+		header.version = EVENT_VERSION;
+		header.eventBytes = sizeof(PhaseEvent);
+		fwrite(&header, sizeof(header), 1, fp);
+		rings = new Ring[EVENT_RINGS];
+		for (k = 0; k < EVENT_RINGS; k++) rings[k].head = rings[k].tail = 0;
+		quit = 0;
+		dropped = 0;
+		written = 0;
+		writer.start(entry, this);
+		return true;
+	}
+
+	bool opened(void)
+	{
+		return fp != NULL;
+	}
+
+	// stops the writer once it has written everything logged so far
+	void close(void)
+	{
+		if (fp == NULL) return;
+		quit = 1;
+		writer.join();
+		fclose(fp);
+		fp = NULL;
+		delete []rings;
+		rings = NULL;
+		if (dropped > 0) fprintf(stderr, "event log: %ld events dropped\n", dropped);
+	}
+
+	inline void log(int step, unsigned int id, int from, int to, float T, float S, const Point2f &pos,
+		int kind = PHASE_CHANGE, int bubble = -1)
+	{
+		long k = threadSlot(), h;
+
+		if (k >= EVENT_RINGS) {
+			atomicAdd(&dropped, 1);
+			return;
+		}
+		Ring &r = rings[k];
+		h = r.head;
+		if (h - r.tail >= EVENT_RING) {
+			atomicAdd(&dropped, 1);
+			return;
+		}
+		PhaseEvent &e = r.e[h & (EVENT_RING - 1)];
+		e.step = step;
+		e.id = id;
+		e.kind = (unsigned char)kind;
+		e.from = (unsigned char)from;
+		e.to = (unsigned char)to;
+		e.pad = 0;
+		e.T = T;
+		e.S = S;
+		e.x = pos.x;
+		e.y = pos.y;
+		e.bubble = bubble;
+		memoryFence();
+		r.head = h + 1;
+	}
+
+	// every event of a log, in the order written
+	static bool load(const char *fileName, std::vector<PhaseEvent> &events)
+	{
+		EventHeader header;
+		PhaseEvent e;
+		FILE *in = fopen(fileName, "rb");
+
+		events.clear();
+		if (in == NULL) return false;
+		if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != EVENT_MAGIC ||
+			header.version != EVENT_VERSION || header.eventBytes != sizeof(PhaseEvent)) {
+			fclose(in);
+			return false;
+		}
+		while (fread(&e, sizeof(e), 1, in) == 1) events.push_back(e);
+		fclose(in);
+		return true;
+	}
+};
+
+#endif
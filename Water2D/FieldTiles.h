@@ -0,0 +1,195 @@
+#ifndef _FIELD_TILES_H_
+#define _FIELD_TILES_H_
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "const.h"
+#include "Point.h"
+#include "particle.h"
+
+// which RENDER_TILE square tiles of an intensity field must be redrawn. The
+// particles of the field's phase are compared, by ID, with where they were
+// when the field was last drawn, so reordering them redraws nothing; a tile is dirty when a particle within
+// reach of it appeared, left or moved. Contour segments are kept per tile,
+// so clean tiles keep theirs.
+class FieldTiles
+{
+private:
+	//by particle ID: where it was drawn, whether it was in the field and
+	//the last scan that met it
+	std::vector<Point2f> drawnPos;
+	std::vector<unsigned char> drawnIn;
+	std::vector<unsigned int> seen;
+	//IDs in the field when last drawn
+	std::vector<unsigned int> drawnIds, ids;
+	unsigned int stamp;
+	bool all;
+
+	void mark(const Point2f &q, float reach)
+	{
+		int i, j, i0, i1, j0, j1;
+
+		i0 = (int)ceil((q.x - reach) * RENDER_SAMPLE);
+		i1 = (int)floor((q.x + reach) * RENDER_SAMPLE);
+		j0 = (int)ceil((q.y - reach) * RENDER_SAMPLE);
+		j1 = (int)floor((q.y + reach) * RENDER_SAMPLE);
+		if (i0 < 0) i0 = 0;
+		if (j0 < 0) j0 = 0;
+		if (i1 > RENDER_SAMPLE - 1) i1 = RENDER_SAMPLE - 1;
+		if (j1 > RENDER_SAMPLE - 1) j1 = RENDER_SAMPLE - 1;
+		for (j = j0 / RENDER_TILE; j <= j1 / RENDER_TILE; j++)
+			for (i = i0 / RENDER_TILE; i <= i1 / RENDER_TILE; i++)
+				dirty[i + j * side] = 1;
+	}
+
+public:
+	//tiles per side
+	int side;
+	//redrawn by the last scan, and since the viewer last uploaded
+	std::vector<unsigned char> dirty, pending;
+	std::vector<std::vector<Point2f> > segA, segB;
+	//cells the contour may pass through, RENDER_SAMPLE per row
+	std::vector<unsigned char> band;
+	//solver table cells holding a particle of the field's phase, so the
+	//band passes of two fields can run at once
+	std::vector<unsigned char> cellHas;
+
+	FieldTiles()
+	{
+		side = (RENDER_SAMPLE + RENDER_TILE - 1) / RENDER_TILE;
+		dirty.assign(side * side, 1);
+		pending.assign(side * side, 1);
+		segA.resize(side * side);
+		segB.resize(side * side);
+		band.assign(RENDER_SAMPLE * RENDER_SAMPLE, 1);
+		stamp = 0;
+		all = true;
+	}
+
+	int tiles(void)
+	{
+		return side * side;
+	}
+
+	// texel or cell range of tile t
+	void bounds(int t, int &i0, int &i1, int &j0, int &j1)
+	{
+		i0 = (t % side) * RENDER_TILE;
+		j0 = (t / side) * RENDER_TILE;
+		i1 = i0 + RENDER_TILE < RENDER_SAMPLE ? i0 + RENDER_TILE : RENDER_SAMPLE;
+		j1 = j0 + RENDER_TILE < RENDER_SAMPLE ? j0 + RENDER_TILE : RENDER_SAMPLE;
+	}
+
+	// the next scan redraws everything
+	void invalidate(void)
+	{
+		all = true;
+	}
+
+	// marks the tiles touched by particles [0, n) of the phase since the
+	// last scan, reach being the kernel radius; returns how many are dirty
+	int scan(const Particle *p, int n, int phase, float reach)
+	{
+		int k, count = 0;
+		unsigned int id;
+		bool was, is;
+
+		std::fill(dirty.begin(), dirty.end(), all ? 1 : 0);
+		stamp++;
+		ids.clear();
+		for (k = 0; k < n; k++) {
+			id = p[k].id;
+			if (id >= seen.size()) {
+				drawnPos.resize(id + 1);
+				drawnIn.resize(id + 1, 0);
+				seen.resize(id + 1, 0);
+			}
+			seen[id] = stamp;
+			was = drawnIn[id] != 0;
+			is = p[k].phase == phase;
+			if (is) ids.push_back(id);
+			if (!was && !is) continue;
+			drawnIn[id] = is;
+			if (was && is && drawnPos[id].x == p[k].pos.x && drawnPos[id].y == p[k].pos.y) continue;
+			if (was && !all) mark(drawnPos[id], reach);
+			if (is && !all) mark(p[k].pos, reach);
+			drawnPos[id] = p[k].pos;
+		}
+		//drawn particles that are gone
+		for (k = 0; k < (int)drawnIds.size(); k++) {
+			id = drawnIds[k];
+			if (seen[id] == stamp) continue;
+			if (!all) mark(drawnPos[id], reach);
+			drawnIn[id] = 0;
+		}
+		drawnIds.swap(ids);
+		all = false;
+
+		for (k = 0; k < side * side; k++) {
+			if (!dirty[k]) continue;
+			pending[k] = 1;
+			count++;
+		}
+		return count;
+	}
+
+	// the cells of tile t read one texel past it, so they follow the tiles
+	// to the right and above as well
+	bool cellsDirty(int t)
+	{
+		int a = t % side, b = t / side;
+
+		return dirty[t] || (a + 1 < side && dirty[t + 1]) || (b + 1 < side && dirty[t + side]) ||
+			(a + 1 < side && b + 1 < side && dirty[t + side + 1]);
+	}
+
+	void clearBand(void)
+	{
+		std::fill(band.begin(), band.end(), 0);
+	}
+
+	// cells with a corner in the box from (x0, y0) to (x1, y1)
+	void markBand(float x0, float y0, float x1, float y1)
+	{
+		int j, i0, i1, j0, j1;
+
+		i0 = (int)ceil(x0 * RENDER_SAMPLE) - 1;
+		i1 = (int)floor(x1 * RENDER_SAMPLE);
+		j0 = (int)ceil(y0 * RENDER_SAMPLE) - 1;
+		j1 = (int)floor(y1 * RENDER_SAMPLE);
+		if (i0 < 0) i0 = 0;
+		if (j0 < 0) j0 = 0;
+		if (i1 > RENDER_SAMPLE - 2) i1 = RENDER_SAMPLE - 2;
+		if (j1 > RENDER_SAMPLE - 2) j1 = RENDER_SAMPLE - 2;
+		if (i0 > i1) return;
+		for (j = j0; j <= j1; j++)
+			memset(&band[i0 + j * RENDER_SAMPLE], 1, i1 - i0 + 1);
+	}
+
+	void clearPending(void)
+	{
+		std::fill(pending.begin(), pending.end(), 0);
+	}
+
+	// trade with the tiles of another field, whose texels are being traded
+	// too; what the viewer holds matches neither any more
+	void swap(FieldTiles &o)
+	{
+		drawnPos.swap(o.drawnPos);
+		drawnIn.swap(o.drawnIn);
+		seen.swap(o.seen);
+		drawnIds.swap(o.drawnIds);
+		std::swap(stamp, o.stamp);
+		segA.swap(o.segA);
+		segB.swap(o.segB);
+		dirty.swap(o.dirty);
+		band.swap(o.band);
+		std::swap(all, o.all);
+		std::fill(pending.begin(), pending.end(), 1);
+		std::fill(o.pending.begin(), o.pending.end(), 1);
+	}
+};
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef _FLUID_STEP_H_
+#define _FLUID_STEP_H_
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "const.h"
+#include "particle.h"
+#include "Params.h"
+#include "SPHCore.h"
+
+// a particle of a validation run, with what the density, force and
+// advance steps read and write
+template <class Real, int Dim>
+struct FluidParticle
+{
+	Real pos[Dim], vel[Dim], acc[Dim];
+	Real dens, pressure, T;
+};
+
+// a particle's vectors as arrays the steps index by axis; Point2f keeps its
+// x and y side by side
+inline const float *position(const Particle &q) { return &q.pos.x; }
+inline float *position(Particle &q) { return &q.pos.x; }
+inline const float *velocity(const Particle &q) { return &q.vel.x; }
+inline float *velocity(Particle &q) { return &q.vel.x; }
+inline float *acceleration(Particle &q) { return &q.acc.x; }
+
+template <class Real, int Dim>
+inline const Real *position(const FluidParticle<Real, Dim> &q) { return q.pos; }
+template <class Real, int Dim>
+inline Real *position(FluidParticle<Real, Dim> &q) { return q.pos; }
+template <class Real, int Dim>
+inline const Real *velocity(const FluidParticle<Real, Dim> &q) { return q.vel; }
+template <class Real, int Dim>
+inline Real *velocity(FluidParticle<Real, Dim> &q) { return q.vel; }
+template <class Real, int Dim>
+inline Real *acceleration(FluidParticle<Real, Dim> &q) { return q.acc; }
+
+// the cell table over the unit box and the density, force and advance
+// steps over it, for particles of type Part in Dim dimensions with the
+// kernels and sums of precision P. The 2D solver steps its particles with
+// one, and FluidSolver steps FluidParticles with others. The owned
+// particles come first and those after them are ghosts, which are
+// neighbours but are not stepped.
+template <class P, int Dim, class Part>
+class FluidStep
+{
+public:
+	typedef SPHCore<P, Dim> Core;
+	typedef typename Core::Tile Tile;
+	typedef typename Core::Sums Sums;
+
+	//kernels and pair loops
+	Core core;
+	int tLen, tSize;
+	//cell table: the particles of cell c are p[cellIndex[cellStart[c]]] up to
+	//p[cellIndex[cellStart[c + 1] - 1]], in index order
+	int *cellStart, *cellIndex, *cellKey;
+
+	FluidStep()
+	{
+		tLen = tSize = 0;
+		cellStart = cellIndex = cellKey = NULL;
+	}
+
+	~FluidStep()
+	{
+		release();
+	}
+
+	void release(void)
+	{
+		if (cellStart != NULL) delete []cellStart;
+		if (cellIndex != NULL) delete []cellIndex;
+		if (cellKey != NULL) delete []cellKey;
+		cellStart = cellIndex = cellKey = NULL;
+	}
+
+	// cells of side h for up to n particles, ghosts included
+	void init(float h, int n)
+	{
+		int d;
+
+		release();
+		core.init(h);
+		tLen = (int)(1.0f / h) + 1;
+		for (tSize = 1, d = 0; d < Dim; d++) tSize *= tLen;
+		cellStart = new int[tSize + 1];
+		//empty until the first countCells, so queries find nothing
+		memset(cellStart, 0, (tSize + 1) * sizeof(int));
+		cellIndex = new int[n];
+		cellKey = new int[n];
+	}
+
+	inline int cellOf(const Part &q)
+	{
+		int d, c = 0;
+
+		for (d = Dim - 1; d >= 0; d--) c = c * tLen + (int)(position(q)[d] / core.kr);
+		return c;
+	}
+
+	// counting sort of particles [0, n) by cell: keys, then cell starts,
+	// then each cell's particles in index order
+	void countCells(const Part *p, int n)
+	{
+		int i;
+
+		for (i = 0; i <= tSize; i++) cellStart[i] = 0;
+		for (i = 0; i < n; i++) {
+			cellKey[i] = cellOf(p[i]);
+			cellStart[cellKey[i] + 1]++;
+		}
+		for (i = 0; i < tSize; i++) cellStart[i + 1] += cellStart[i];
+		for (i = 0; i < n; i++) cellIndex[cellStart[cellKey[i]]++] = i;
+		//every start has moved up to the next cell's, shift them back
+		for (i = tSize; i > 0; i--) cellStart[i] = cellStart[i - 1];
+		cellStart[0] = 0;
+	}
+
+	// first and last + 1 position in cellIndex of neighbour row k of cell
+	// c, the cells beside and including c's along x, which are one run;
+	// false when the row is outside the table
+	inline bool rowRun(int c, int k, int &from, int &to)
+	{
+		int x = c % tLen, y = c / tLen % tLen + Core::rowOffset(k, 0);
+		int z = c / tLen / tLen + (Dim == 3 ? Core::rowOffset(k, 1) : 0);
+
+		if (y < 0 || y > tLen - 1 || z < 0 || z > tLen - 1) return false;
+		y = (y + z * tLen) * tLen;
+		from = cellStart[(x > 0 ? x - 1 : 0) + y];
+		to = cellStart[(x < tLen - 1 ? x + 2 : tLen) + y];
+		return true;
+	}
+
+	// fills t from cellIndex[from, to), ghosts too unless ownedOnly, up to
+	// PAIR_TILE particles; returns where it stopped
+	int loadTile(Tile &t, const Part *p, int owned, int from, int to, bool ownedOnly)
+	{
+		int i, k, d;
+
+		for (t.n = 0, k = from; k < to && t.n < PAIR_TILE; k++) {
+			i = cellIndex[k];
+			if (ownedOnly && i >= owned) continue;
+			t.index[t.n] = i;
+			for (d = 0; d < Dim; d++) {
+				t.x[d][t.n] = position(p[i])[d];
+				t.v[d][t.n] = velocity(p[i])[d];
+			}
+			t.dens[t.n] = p[i].dens;
+			t.pressure[t.n] = p[i].pressure;
+			t.T[t.n] = p[i].T;
+			t.n++;
+		}
+		return k;
+	}
+
+	// kernel sums over the neighbours of the owned particles in cells
+	// [begin, end), each handed to done(i, sum) for its particle i. A cell's
+	// particles, PAIR_TILE at a time, meet the particles of the rows of
+	// cells around it, so each neighbour is loaded once per tile rather
+	// than once per particle.
+	template <class Done>
+	void density(const Part *p, int owned, int begin, int end, bool table, Done done)
+	{
+		int a, c, k, h, m, mEnd;
+		Tile home, near;
+		Sums sums;
+
+		for (c = begin; c < end; c++) {
+			for (h = cellStart[c]; h < cellStart[c + 1]; ) {
+				h = loadTile(home, p, owned, h, cellStart[c + 1], true);
+				for (a = 0; a < home.n; a++) sums.dens[a] = 0;
+				for (k = 0; k < Core::rows; k++) {
+					if (!rowRun(c, k, m, mEnd)) continue;
+					while (m < mEnd) {
+						m = loadTile(near, p, owned, m, mEnd, false);
+						if (table) core.template densityPairs<true>(home, near, &sums);
+						else core.template densityPairs<false>(home, near, &sums);
+					}
+				}
+				for (a = 0; a < home.n; a++) done(home.index[a], sums.dens[a]);
+			}
+		}
+	}
+
+	// pressure, viscosity and heat sums of the owned particles in cells
+	// [begin, end), tile by tile as in density; done(i, sums, a) gets
+	// particle i's, which are lane a of sums
+	template <class Done>
+	void force(const Part *p, int owned, int begin, int end, bool table, Done done)
+	{
+		int a, c, d, k, h, m, mEnd;
+		Tile home, near;
+		Sums sums;
+
+		for (c = begin; c < end; c++) {
+			for (h = cellStart[c]; h < cellStart[c + 1]; ) {
+				h = loadTile(home, p, owned, h, cellStart[c + 1], true);
+				for (a = 0; a < home.n; a++) {
+					for (d = 0; d < Dim; d++) sums.ap[d][a] = sums.av[d][a] = 0;
+					sums.heat[a] = 0;
+				}
+				for (k = 0; k < Core::rows; k++) {
+					if (!rowRun(c, k, m, mEnd)) continue;
+					while (m < mEnd) {
+						m = loadTile(near, p, owned, m, mEnd, false);
+						if (table) core.template forcePairs<true>(home, near, &sums);
+						else core.template forcePairs<false>(home, near, &sums);
+					}
+				}
+				for (a = 0; a < home.n; a++) done(home.index[a], sums, a);
+			}
+		}
+	}
+
+	// symplectic Euler over a step of h
+	template <class T>
+	static inline void integrate(Part &q, T h)
+	{
+		int d;
+
+		for (d = 0; d < Dim; d++) {
+			velocity(q)[d] += acceleration(q)[d] * h;
+			position(q)[d] += velocity(q)[d] * h;
+		}
+	}
+
+	// the cell table covers the unit box only; a particle leaving it is
+	// put back on the side and bounces
+	template <class T>
+	static inline void clampBox(Part &q, T elasticity)
+	{
+		int d;
+
+		for (d = 0; d < Dim; d++) {
+			if (position(q)[d] < 0) {
+				position(q)[d] = 0;
+				velocity(q)[d] = -velocity(q)[d] * elasticity;
+			}
+			else if (position(q)[d] > 1) {
+				position(q)[d] = 1;
+				velocity(q)[d] = -velocity(q)[d] * elasticity;
+			}
+		}
+	}
+};
+
+// a plain fluid of FluidParticles settling in the unit box, with none of the
+// 2D solver's walls, heat or air: its density, force and advance steps in
+// any precision and dimension, so a change to them can be run in double
+// and in 3D. The fluid is laid out at the 2D rest spacing, each particle
+// weighing what a cell of it holds at rest density
+template <class P, int Dim>
+class FluidSolver
+{
+public:
+	typedef typename P::Real Real;
+	typedef typename P::Accum Accum;
+	typedef FluidParticle<Real, Dim> Part;
+	typedef FluidStep<P, Dim, Part> Step;
+
+	// density with the particle's own kernel weight, and pressure by the
+	// 2D solver's equation of state
+	struct Density
+	{
+		FluidSolver *s;
+		Density(FluidSolver *solver) : s(solver) {}
+		void operator()(int i, Accum sum) const
+		{
+			Part &q = s->p[i];
+
+			q.dens = s->mass * ((Real)sum + s->self);
+			q.pressure = s->gasConstant * (CUBE(q.dens / s->restDensity) - (Real)1);
+		}
+	};
+
+	// the 2D solver's sums leave out each particle's volume, which its unit
+	// mass makes 1 / restDensity at rest; they are weighed by it here, over
+	// that, so a 3D fluid is as stiff as the 2D one
+	struct Force
+	{
+		FluidSolver *s;
+		Force(FluidSolver *solver) : s(solver) {}
+		void operator()(int i, const typename Step::Sums &sums, int a) const
+		{
+			int d;
+			Part &q = s->p[i];
+			Real v = s->volume / q.dens;
+
+			for (d = 0; d < Dim; d++)
+				q.acc[d] = v * ((Real)0.5 * (Real)sums.ap[d][a] + s->viscosity * (Real)sums.av[d][a]);
+			q.acc[1] -= s->gravity;
+		}
+	};
+
+	Step fluid;
+	std::vector<Part> p;
+	Real mass, volume, self, restDensity, gasConstant, viscosity, gravity, elasticity, h;
+
+	// a layer of fluid `depth` deep across the bottom of the box, at rest
+	void init(const SimParams &param, Real depth)
+	{
+		int i, k, d, n = 1, across[Dim];
+		Real spacing = (Real)sqrt(param.mass / param.restDensity);
+
+		restDensity = param.restDensity;
+		gasConstant = param.gasConstant;
+		viscosity = param.viscosity;
+		gravity = param.gravity;
+		elasticity = param.elasticity;
+		h = param.timeStep;
+		mass = restDensity;
+		for (d = 0; d < Dim; d++) {
+			across[d] = (int)((d == 1 ? depth : (Real)1) / spacing);
+			n *= across[d];
+			mass *= spacing;
+		}
+		volume = mass / param.mass * restDensity;
+		fluid.init(param.kr, n);
+		self = fluid.core.poly6((Real)0);
+		p.resize(n);
+		for (i = 0; i < n; i++) {
+			Part &q = p[i];
+			for (d = 0, k = i; d < Dim; k /= across[d], d++) {
+				q.pos[d] = ((Real)(k % across[d]) + (Real)0.5) * spacing;
+				q.vel[d] = q.acc[d] = (Real)0;
+			}
+			q.dens = restDensity;
+			q.pressure = q.T = (Real)0;
+		}
+	}
+
+	void step(void)
+	{
+		int i, chunks = (fluid.tSize + CELL_GRAIN - 1) / CELL_GRAIN, n = (int)p.size();
+
+		fluid.countCells(&p[0], n);
+#pragma omp parallel for schedule(dynamic)
+		for (i = 0; i < chunks; i++)
+			fluid.density(&p[0], n, i * CELL_GRAIN, (i + 1) * CELL_GRAIN < fluid.tSize ? (i + 1) * CELL_GRAIN : fluid.tSize, false, Density(this));
+#pragma omp parallel for schedule(dynamic)
+		for (i = 0; i < chunks; i++)
+			fluid.force(&p[0], n, i * CELL_GRAIN, (i + 1) * CELL_GRAIN < fluid.tSize ? (i + 1) * CELL_GRAIN : fluid.tSize, false, Force(this));
+#pragma omp parallel for schedule(static)
+		for (i = 0; i < n; i++) {
+			Step::integrate(p[i], h);
+			Step::clampBox(p[i], elasticity);
+		}
+	}
+};
+
+// a layer of fluid a quarter of the box deep settling under gravity,
+// stepped with FluidSolver<P, Dim>: its mean and worst density over rest,
+// top speed and mean height after the steps, which should agree between
+// instantiations, for validating the 2D solver's steps in double and 3D
+template <class P, int Dim>
+void checkSolver(FILE *out, const char *name, const SimParams &param, int steps)
+{
+	FluidSolver<P, Dim> s;
+	int i, k, n;
+	double e, mean = 0.0, worst = 0.0, v2, vmax = 0.0, y = 0.0;
+
+	s.init(param, (typename P::Real)0.25);
+	for (k = 0; k < steps; k++) s.step();
+	n = (int)s.p.size();
+	for (i = 0; i < n; i++) {
+		e = s.p[i].dens / s.restDensity - 1.0;
+		mean += e;
+		if (e > worst || e != e) worst = e;
+		for (v2 = 0.0, k = 0; k < Dim; k++) v2 += (double)s.p[i].vel[k] * s.p[i].vel[k];
+		if (v2 > vmax || v2 != v2) vmax = v2;
+		y += s.p[i].pos[1];
+	}
+	fprintf(out, "%-10s %10d %10d %10.4f %10.4f %10.4f %10.4f\n", name, n, steps,
+		mean / n, worst, sqrt(vmax), y / n);
+}
+
+inline void checkSolvers(FILE *out, const SimParams &param, int steps)
+{
+	fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s\n", "solver", "particles", "steps", "density",
+		"worst", "speed", "height");
+	checkSolver<FloatPrecision, 2>(out, "float 2D", param, steps);
+	checkSolver<MixedPrecision, 2>(out, "mixed 2D", param, steps);
+	checkSolver<DoublePrecision, 2>(out, "double 2D", param, steps);
+	checkSolver<DoublePrecision, 3>(out, "double 3D", param, steps);
+}
+
+#endif
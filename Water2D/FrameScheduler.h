@@ -0,0 +1,174 @@
+#ifndef _FRAME_SCHEDULER_H_
+#define _FRAME_SCHEDULER_H_
+
+#ifdef _WIN32
+//no winsock.h, so winsock2.h may still come after
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <mmsystem.h>
+#pragma comment (lib, "winmm.lib")
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+#include <algorithm>
+#include <vector>
+#include "const.h"
+
+// paces the viewer loop: simulation steps fall due at one rate, frames at
+// another, and in between the thread sleeps. Sleeps end spinMargin early
+// and the rest is spun, since Windows only wakes threads to about a
+// millisecond; clock_nanosleep is good to well under that. Frame times of
+// the last FRAME_HISTORY frames are kept for percentiles.
+class FrameScheduler
+{
+private:
+	double simPeriod, renderPeriod;
+	double nextSim, nextRender, lastFrame;
+	std::vector<double> history;
+	int current, filled;
+	std::vector<double> sorted;
+#ifdef _WIN32
+	double frequency;
+#endif
+
+	void sleepUntil(double t)
+	{
+		double left = t - now() - spinMargin;
+
+		if (left > 0.0) {
+#ifdef _WIN32
+			Sleep((DWORD)(left * 1000.0));
+#else
+			struct timespec ts;
+			double until = t - spinMargin;
+			ts.tv_sec = (time_t)until;
+			ts.tv_nsec = (long)((until - (double)ts.tv_sec) * 1e9);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+#endif
+		}
+		while (now() < t) {}
+	}
+
+public:
+	//at most this many steps are caught up at once after a stall
+	int maxCatchUp;
+	double spinMargin;
+
+	FrameScheduler()
+	{
+#ifdef _WIN32
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		frequency = 1.0 / (double)f.QuadPart;
+		//1 ms scheduler ticks, so Sleep can be trusted to SLEEP_MARGIN
+		timeBeginPeriod(1);
+		spinMargin = SLEEP_MARGIN;
+#else
+		spinMargin = 0.125 * SLEEP_MARGIN;
+#endif
+		maxCatchUp = 4;
+		init(120.0, 60.0);
+	}
+
+	~FrameScheduler()
+	{
+#ifdef _WIN32
+		timeEndPeriod(1);
+#endif
+	}
+
+	// monotonic seconds
+	double now(void)
+	{
+#ifdef _WIN32
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return (double)t.QuadPart * frequency;
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#endif
+	}
+
+	void init(double simHz, double renderHz)
+	{
+		simPeriod = 1.0 / simHz;
+		renderPeriod = 1.0 / renderHz;
+		nextSim = nextRender = lastFrame = now();
+		history.assign(FRAME_HISTORY, 0.0);
+		current = filled = 0;
+	}
+
+	// steps due now; while paused no steps fall due and none pile up
+	int simSteps(bool running)
+	{
+		int n = 0;
+		double t = now();
+
+		if (!running) {
+			nextSim = t;
+			return 0;
+		}
+		while (nextSim <= t && n < maxCatchUp) {
+			nextSim += simPeriod;
+			n++;
+		}
+		//too far behind to catch up, drop the backlog
+		if (nextSim <= t) nextSim = t + simPeriod;
+		return n;
+	}
+
+	bool renderDue(void)
+	{
+		return now() >= nextRender;
+	}
+
+	// a frame went to the screen
+	void presented(void)
+	{
+		double t = now();
+
+		history[current] = t - lastFrame;
+		current = (current + 1) % FRAME_HISTORY;
+		if (filled < FRAME_HISTORY) filled++;
+		lastFrame = t;
+		nextRender += renderPeriod;
+		if (nextRender <= t) nextRender = t + renderPeriod;
+	}
+
+	// sleep until the next step or frame falls due
+	void wait(bool running)
+	{
+		double t = nextRender;
+
+		if (running && nextSim < t) t = nextSim;
+		sleepUntil(t);
+	}
+
+	// frame time in seconds below which fraction p of the recent frames fall
+	double percentile(double p)
+	{
+		int k;
+
+		if (filled == 0) return 0.0;
+		sorted.assign(history.begin(), history.begin() + filled);
+		k = (int)(p * (filled - 1) + 0.5);
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		return sorted[k];
+	}
+
+	double avgHz(void)
+	{
+		int i;
+		double sum = 0.0;
+
+		for (i = 0; i < filled; i++) sum += history[i];
+		return sum > 0.0 ? filled / sum : 0.0;
+	}
+};
+
+#endif
@@ -8,7 +8,8 @@ struct GridData
 	float DT;
 	float T;
 	Point2f pos;
-	std::vector<Particle *> pv;
+	//bilinear weight of the particles splatted here, and of those that are ice
+	float w, wIce;
 	bool flagOfData;
 	void updateParticles()
 	{
@@ -0,0 +1,43 @@
+#ifndef _KERNEL_TABLE_H_
+#define _KERNEL_TABLE_H_
+
+#include "const.h"
+
+// a radial kernel sampled uniformly in r^2 over [0, r2max] and read back with
+// linear interpolation; small enough to stay in L1 next to the particle data
+class KernelTable
+{
+private:
+	float r2max, scale;
+	float v[KERNEL_TABLE_SIZE + 1];
+
+public:
+	KernelTable()
+	{
+		r2max = 0.0f;
+		scale = 0.0f;
+	}
+
+	//f is called with r^2
+	template <class F>
+	void build(F f, float range)
+	{
+		int k;
+
+		r2max = range;
+		scale = KERNEL_TABLE_SIZE / range;
+		for (k = 0; k <= KERNEL_TABLE_SIZE; k++)
+			v[k] = f(range * k / KERNEL_TABLE_SIZE);
+	}
+
+	inline float operator()(float r2) const
+	{
+		if (r2 >= r2max) return 0.0f;
+		float t = r2 * scale;
+		int k = (int)t;
+		float a = t - k;
+		return v[k] + a * (v[k + 1] - v[k]);
+	}
+};
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "Thread.h"
+
+enum Stage { STAGE_LAYOUT, STAGE_DENSITY, STAGE_FORCE, STAGE_ADVANCE, STAGE_HEAT, STAGE_AIR, STAGE_FIELDS, STAGES };
+
+static const char *const stageNames[STAGES] = { "layout", "density", "force", "advance", "heat", "air", "fields" };
+
+enum MetricsFormat { METRICS_JSONL, METRICS_PROMETHEUS };
+
+// health of a run after one step. Mass and air are what should be
+// conserved: the mass changes only as particles are emitted or removed, and
+// the air only moves between the particles and the bubbles until a bubble
+// bursts. airDrift is the air held, dissolved and in bubbles, less what the
+// emitters brought in and what bursting bubbles and removed particles let
+// out, which stays near zero while air is conserved. densityError is the
+// worst compression over rest density, which grows without bound as a run
+// blows up
+struct StepMetrics
+{
+	int step, particles, bubbles;
+	float mass, kinetic, densityError, iceFraction;
+	float dissolvedAir, bubbleAir, maxSpeed;
+	float airInjected, airReleased, airDrift;
+	//seconds spent in each stage over the last steps steps, summed over
+	//the threads running it
+	int steps;
+	double stage[STAGES];
+};
+
+// writes metrics where monitoring can pick them up: appended to a file
+// one JSON object per line, or as Prometheus text, which replaces the file
+// whole every time so a scraper never reads half of it. A target of
+// unix:path streams to a Unix socket instead, JSON lines or expositions
+// ended by # EOF, and connects again after the reader goes away.
+class MetricsExporter
+{
+private:
+	std::string target, tmp, text;
+	int format;
+	FILE *fp;
+	int sock;
+	//stage seconds since open, for the Prometheus counters
+	double total[STAGES];
+
+	bool socketTarget(void)
+	{
+		return target.compare(0, 5, "unix:") == 0;
+	}
+
+	bool connect(void)
+	{
+#ifdef _WIN32
+		return false;
+#else
+		struct sockaddr_un a;
+
+		if (sock >= 0) return true;
+		memset(&a, 0, sizeof(a));
+		a.sun_family = AF_UNIX;
+		if (target.size() - 5 >= sizeof(a.sun_path)) return false;
+		strcpy(a.sun_path, target.c_str() + 5);
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0) return false;
+		if (::connect(sock, (struct sockaddr *)&a, sizeof(a)) != 0) {
+			::close(sock);
+			sock = -1;
+			return false;
+		}
+		return true;
+#endif
+	}
+
+	void send(void)
+	{
+#ifndef _WIN32
+		size_t done = 0;
+		ssize_t n;
+
+		if (!connect()) return;
+		while (done < text.size()) {
+			n = ::send(sock, text.c_str() + done, text.size() - done, MSG_NOSIGNAL);
+			if (n <= 0) {
+				::close(sock);
+				sock = -1;
+				return;
+			}
+			done += n;
+		}
+#endif
+	}
+
+	void replace(void)
+	{
+		FILE *out = fopen(tmp.c_str(), "wt");
+
+		if (out == NULL) return;
+		fputs(text.c_str(), out);
+		fclose(out);
+#ifdef _WIN32
+		MoveFileExA(tmp.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+		rename(tmp.c_str(), target.c_str());
+#endif
+	}
+
+	//JSON has no NaN or infinity; Prometheus spells them its own way
+	void number(double v)
+	{
+		char buffer[32];
+
+		if (v == v && v - v == 0.0) sprintf(buffer, "%.9g", v);
+		else if (format == METRICS_JSONL) strcpy(buffer, "null");
+		else strcpy(buffer, v != v ? "NaN" : v > 0.0 ? "+Inf" : "-Inf");
+		text += buffer;
+	}
+
+	void field(const char *name, double v)
+	{
+		text += ",\"";
+		text += name;
+		text += "\":";
+		number(v);
+	}
+
+	void sample(const char *name, const char *type, const char *help, double v)
+	{
+		text += "# HELP water2d_";
+		text += name;
+		text += " ";
+		text += help;
+		text += "\n# TYPE water2d_";
+		text += name;
+		text += " ";
+		text += type;
+		text += "\nwater2d_";
+		text += name;
+		text += " ";
+		number(v);
+		text += "\n";
+	}
+
+	void json(const StepMetrics &m)
+	{
+		int k;
+
+		text = "{\"step\":";
+		number(m.step);
+		field("particles", m.particles);
+		field("mass", m.mass);
+		field("kinetic_energy", m.kinetic);
+		field("density_error", m.densityError);
+		field("ice_fraction", m.iceFraction);
+		field("bubbles", m.bubbles);
+		field("dissolved_air", m.dissolvedAir);
+		field("bubble_air", m.bubbleAir);
+		field("air_injected", m.airInjected);
+		field("air_released", m.airReleased);
+		field("air_drift", m.airDrift);
+		field("max_speed", m.maxSpeed);
+		field("steps", m.steps);
+		text += ",\"stage_seconds\":{";
+		for (k = 0; k < STAGES; k++) {
+			if (k > 0) text += ",";
+			text += "\"";
+			text += stageNames[k];
+			text += "\":";
+			number(m.stage[k]);
+		}
+		text += "}}\n";
+	}
+
+	void prometheus(const StepMetrics &m)
+	{
+		int k;
+
+		text.clear();
+		sample("step", "counter", "Steps taken since the run began.", m.step);
+		sample("particles", "gauge", "Particles in the simulation.", m.particles);
+		sample("mass", "gauge", "Total particle mass.", m.mass);
+		sample("kinetic_energy", "gauge", "Total kinetic energy of the particles.", m.kinetic);
+		sample("density_error", "gauge", "Worst compression over rest density.", m.densityError);
+		sample("ice_fraction", "gauge", "Fraction of the particles frozen.", m.iceFraction);
+		sample("bubbles", "gauge", "Air bubbles in the water.", m.bubbles);
+		sample("dissolved_air", "gauge", "Air dissolved in the particles.", m.dissolvedAir);
+		sample("bubble_air", "gauge", "Air held in bubbles.", m.bubbleAir);
+		sample("air_injected", "counter", "Air brought in by the emitters since the run began.", m.airInjected);
+		sample("air_released", "counter", "Air let out by bubbles and removed particles since the run began.", m.airReleased);
+		sample("air_drift", "gauge", "Air held less air injected plus air released, zero when conserved.", m.airDrift);
+		sample("max_speed", "gauge", "Speed of the fastest particle.", m.maxSpeed);
+		text += "# HELP water2d_stage_seconds_total Seconds spent in each stage, summed over threads.\n";
+		text += "# TYPE water2d_stage_seconds_total counter\n";
+		for (k = 0; k < STAGES; k++) {
+			text += "water2d_stage_seconds_total{stage=\"";
+			text += stageNames[k];
+			text += "\"} ";
+			number(total[k]);
+			text += "\n";
+		}
+		if (socketTarget()) text += "# EOF\n";
+	}
+
+public:
+	MetricsExporter()
+	{
+		fp = NULL;
+		sock = -1;
+		format = METRICS_JSONL;
+	}
+
+	~MetricsExporter()
+	{
+		close();
+	}
+
+	bool open(const char *to, int fmt)
+	{
+		int k;
+
+		close();
+		target = to;
+		tmp = target + ".tmp";
+		format = fmt;
+		for (k = 0; k < STAGES; k++) total[k] = 0.0;
+		if (socketTarget() ? connect() : format != METRICS_JSONL || (fp = fopen(to, "wt")) != NULL) return true;
+		close();
+		return false;
+	}
+
+	bool opened(void)
+	{
+		return !target.empty();
+	}
+
+	void close(void)
+	{
+		if (fp != NULL) fclose(fp);
+		fp = NULL;
+#ifndef _WIN32
+		if (sock >= 0) ::close(sock);
+#endif
+		sock = -1;
+		target.clear();
+	}
+
+	void write(const StepMetrics &m)
+	{
+		int k;
+
+		if (!opened()) return;
+		for (k = 0; k < STAGES; k++) total[k] += m.stage[k];
+		if (format == METRICS_JSONL) json(m);
+		else prometheus(m);
+		if (socketTarget()) send();
+		else if (fp != NULL) {
+			fputs(text.c_str(), fp);
+			fflush(fp);
+		}
+		else replace();
+	}
+};
+
+#endif
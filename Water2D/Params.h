@@ -0,0 +1,135 @@
+#ifndef _PARAMS_H_
+#define _PARAMS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "const.h"
+
+// per-instance simulation parameters, defaulting to the values in const.h
+struct SimParams
+{
+	float timeStep;
+	float gravity;
+	float mass;
+	float kr;
+	float restDensity;
+	float gasConstant;
+	float viscosity;
+	float elasticity;
+	float wallStiffness;
+	int maxParticles;
+	//room for ghost copies in a distributed run
+	int maxGhosts;
+
+	//thermal
+	float cThermalWater;
+	float cThermalIce;
+	float Tair;
+	float Tfreeze;
+	float Twater;
+	//particles conduct heat among themselves and into the walls instead
+	//of through the thermal grid; diffusivity per unit of cThermal*
+	int conduction;
+	float conductivity;
+
+	//the scene's emitter: an EmitShape, particles per step and per batch
+	int emitShape;
+	float emitRate;
+	int emitBatch;
+	float emitSize;
+	float emitX, emitY, emitVX, emitVY;
+	//particles leaving the unit square are removed instead of held at its
+	//edge
+	int openBoundary;
+	//particles turned to air by wall contact are removed, and so are
+	//bubbles that reach a wall, rather than resting against it
+	int removeAir;
+
+	SimParams()
+	{
+		timeStep = TIME_STEP;
+		gravity = GRAVITY;
+		mass = MASS;
+		kr = KR;
+		restDensity = DEFAULT_DENSITY;
+		gasConstant = GAS_CONSTANT;
+		viscosity = VISCOSITY;
+		elasticity = ELASTICITY;
+		wallStiffness = WALL_STIFFNESS;
+		maxParticles = PARTICLE_NUM;
+		maxGhosts = 0;
+		cThermalWater = ::cThermalWater;
+		cThermalIce = ::cThermalIce;
+		Tair = ::Tair;
+		Tfreeze = ::Tfreeze;
+		Twater = ::Twater;
+		conduction = 0;
+		conductivity = CONDUCTIVITY;
+		emitShape = 0;
+		emitRate = 4.0f;
+		emitBatch = 4;
+		emitSize = 0.015625f;
+		emitX = 0.2f;
+		emitY = 0.8f;
+		emitVX = 0.8f;
+		emitVY = 0.6f;
+		openBoundary = 0;
+		removeAir = 0;
+	}
+
+	//false if key is not a parameter
+	bool set(const char *key, const char *value)
+	{
+		float v = (float)atof(value);
+
+		if (strcmp(key, "timeStep") == 0) timeStep = v;
+		else if (strcmp(key, "gravity") == 0) gravity = v;
+		else if (strcmp(key, "mass") == 0) mass = v;
+		else if (strcmp(key, "kr") == 0) kr = v;
+		else if (strcmp(key, "restDensity") == 0) restDensity = v;
+		else if (strcmp(key, "gasConstant") == 0) gasConstant = v;
+		else if (strcmp(key, "viscosity") == 0) viscosity = v;
+		else if (strcmp(key, "elasticity") == 0) elasticity = v;
+		else if (strcmp(key, "wallStiffness") == 0) wallStiffness = v;
+		else if (strcmp(key, "maxParticles") == 0) maxParticles = atoi(value);
+		else if (strcmp(key, "maxGhosts") == 0) maxGhosts = atoi(value);
+		else if (strcmp(key, "cThermalWater") == 0) cThermalWater = v;
+		else if (strcmp(key, "cThermalIce") == 0) cThermalIce = v;
+		else if (strcmp(key, "Tair") == 0) Tair = v;
+		else if (strcmp(key, "Tfreeze") == 0) Tfreeze = v;
+		else if (strcmp(key, "Twater") == 0) Twater = v;
+		else if (strcmp(key, "conduction") == 0) conduction = atoi(value);
+		else if (strcmp(key, "conductivity") == 0) conductivity = v;
+		else if (strcmp(key, "emitShape") == 0) emitShape = atoi(value);
+		else if (strcmp(key, "emitRate") == 0) emitRate = v;
+		else if (strcmp(key, "emitBatch") == 0) emitBatch = atoi(value);
+		else if (strcmp(key, "emitSize") == 0) emitSize = v;
+		else if (strcmp(key, "emitX") == 0) emitX = v;
+		else if (strcmp(key, "emitY") == 0) emitY = v;
+		else if (strcmp(key, "emitVX") == 0) emitVX = v;
+		else if (strcmp(key, "emitVY") == 0) emitVY = v;
+		else if (strcmp(key, "openBoundary") == 0) openBoundary = atoi(value);
+		else if (strcmp(key, "removeAir") == 0) removeAir = atoi(value);
+		else return false;
+		return true;
+	}
+
+	// "key value" lines, '#' starts a comment
+	bool load(const char *fileName)
+	{
+		char line[256], key[128], value[128];
+		FILE *fp = fopen(fileName, "rt");
+
+		if (!fp) return false;
+		while (fgets(line, 256, fp)) {
+			if (sscanf(line, "%127s %127s", key, value) != 2 || key[0] == '#') continue;
+			if (!set(key, value))
+				fprintf(stderr, "%s: unknown parameter %s\n", fileName, key);
+		}
+		fclose(fp);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef _RECORDING_H_
+#define _RECORDING_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "SPH.h"
+#include "Params.h"
+#include "SharedState.h"
+
+#define RECORD_MAGIC 0x57443252
+#define RECORD_VERSION 4
+
+// a recorded run: the header, then one record per frame, then the offsets of
+// all records so any frame can be found without reading the ones before it.
+// A run that was cut short has no offsets and is indexed by walking the
+// records instead.
+struct RecordHeader
+{
+	unsigned int magic, version;
+	SimParams param;
+	int frames;
+	long long indexOffset;
+};
+
+// followed by pNum particles and nBubbles (x, y, r) triples
+struct RecordFrame
+{
+	unsigned int bytes;
+	int step;
+	int pNum, nBubbles;
+	float iceFraction, totalAir, maxSpeed;
+};
+
+class Recorder
+{
+private:
+	FILE *fp;
+	RecordHeader header;
+	long long offset;
+	std::vector<long long> index;
+	std::vector<SharedParticle> q;
+
+public:
+	Recorder()
+	{
+		fp = NULL;
+	}
+
+	~Recorder()
+	{
+		close();
+	}
+
+	bool open(const char *fileName, const SimParams &param)
+	{
+		close();
+		fp = fopen(fileName, "wb");
+		if (!fp) return false;
+		header.magic = RECORD_MAGIC;
+		header.version = RECORD_VERSION;
+		header.param = param;
+		header.frames = 0;
+		header.indexOffset = 0;
+		fwrite(&header, sizeof(header), 1, fp);
+		offset = sizeof(header);
+		index.clear();
+		return true;
+	}
+
+	bool opened(void)
+	{
+		return fp != NULL;
+	}
+
+	void write(SPH &s, int step)
+	{
+		int i;
+		RecordFrame f;
+
+		q.resize(s.pNum);
+		for (i = 0; i < s.pNum; i++) {
+			q[i].x = s.p[i].pos.x;
+			q[i].y = s.p[i].pos.y;
+			q[i].vx = s.p[i].vel.x;
+			q[i].vy = s.p[i].vel.y;
+			q[i].dens = s.p[i].dens;
+			q[i].T = s.p[i].T;
+			q[i].S = s.p[i].S;
+			q[i].phase = s.p[i].phase;
+			q[i].id = s.p[i].id;
+		}
+		f.step = step;
+		f.pNum = s.pNum;
+		f.nBubbles = (int)s.bubbles.instance.size() / 3;
+		f.iceFraction = s.stats.iceFraction;
+		f.totalAir = s.stats.totalAir;
+		f.maxSpeed = s.stats.maxSpeed;
+		f.bytes = sizeof(f) + f.pNum * sizeof(SharedParticle) + 3 * f.nBubbles * sizeof(float);
+
+		fwrite(&f, sizeof(f), 1, fp);
+		if (f.pNum > 0) fwrite(&q[0], sizeof(SharedParticle), f.pNum, fp);
+		if (f.nBubbles > 0) fwrite(&s.bubbles.instance[0], sizeof(float), 3 * f.nBubbles, fp);
+		index.push_back(offset);
+		offset += f.bytes;
+	}
+
+	void close(void)
+	{
+		if (fp == NULL) return;
+		if (!index.empty()) fwrite(&index[0], sizeof(long long), index.size(), fp);
+		header.frames = (int)index.size();
+		header.indexOffset = offset;
+		fseek(fp, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, fp);
+		fclose(fp);
+		fp = NULL;
+	}
+};
+
+// a recorded run mapped into memory; frames are read in place
+class Recording
+{
+private:
+	const char *base;
+	long long bytes;
+	std::vector<long long> index;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+
+	const RecordHeader *header(void) { return (const RecordHeader *)base; }
+
+public:
+	Recording()
+	{
+		base = NULL;
+		bytes = 0;
+#ifdef _WIN32
+		file = mapping = NULL;
+#endif
+	}
+
+	~Recording()
+	{
+		close();
+	}
+
+	bool open(const char *fileName)
+	{
+		long long at;
+		const RecordFrame *f;
+
+		close();
+#ifdef _WIN32
+		LARGE_INTEGER size;
+		file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			file = NULL;
+			return false;
+		}
+		GetFileSizeEx(file, &size);
+		bytes = size.QuadPart;
+		mapping = bytes > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		base = mapping ? (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if (base == NULL) {
+			close();
+			return false;
+		}
+#else
+		struct stat st;
+		int fd = ::open(fileName, O_RDONLY);
+		if (fd < 0) return false;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		bytes = st.st_size;
+		base = (const char *)mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (base == (const char *)MAP_FAILED) {
+			base = NULL;
+			return false;
+		}
+#endif
+		if (bytes < (long long)sizeof(RecordHeader) ||
+			header()->magic != RECORD_MAGIC || header()->version != RECORD_VERSION) {
+			close();
+			return false;
+		}
+
+		index.clear();
+		if (header()->indexOffset > 0 &&
+			header()->indexOffset + header()->frames * (long long)sizeof(long long) <= bytes) {
+			const long long *offsets = (const long long *)(base + header()->indexOffset);
+			index.assign(offsets, offsets + header()->frames);
+		}
+		else {
+			//unfinished recording, keep every complete record
+			for (at = sizeof(RecordHeader); at + (long long)sizeof(RecordFrame) <= bytes; at += f->bytes) {
+				f = (const RecordFrame *)(base + at);
+				if (f->bytes < sizeof(RecordFrame) || at + f->bytes > bytes) break;
+				index.push_back(at);
+			}
+		}
+		return true;
+	}
+
+	void close(void)
+	{
+#ifdef _WIN32
+		if (base != NULL) UnmapViewOfFile(base);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != NULL) CloseHandle(file);
+		file = mapping = NULL;
+#else
+		if (base != NULL) munmap((void *)base, bytes);
+#endif
+		base = NULL;
+		index.clear();
+	}
+
+	int frames(void)
+	{
+		return (int)index.size();
+	}
+
+	const SimParams &param(void)
+	{
+		return header()->param;
+	}
+
+	const RecordFrame *frame(int k)
+	{
+		return (const RecordFrame *)(base + index[k]);
+	}
+
+	const SharedParticle *particles(const RecordFrame *f)
+	{
+		return (const SharedParticle *)(f + 1);
+	}
+
+	const float *bubbles(const RecordFrame *f)
+	{
+		return (const float *)(particles(f) + f->pNum);
+	}
+
+	// particles and bubbles of frame k into s, which must hold enough
+	void load(int k, SPH &s)
+	{
+		int i;
+		const RecordFrame *f = frame(k);
+		const SharedParticle *q = particles(f);
+		const float *b = bubbles(f);
+
+		s.pNum = f->pNum < s.param.maxParticles ? f->pNum : s.param.maxParticles;
+		s.gNum = 0;
+		for (i = 0; i < s.pNum; i++) {
+			s.p[i].pos.Set(q[i].x, q[i].y);
+			s.p[i].vel.Set(q[i].vx, q[i].vy);
+			s.p[i].dens = q[i].dens;
+			s.p[i].T = q[i].T;
+			s.p[i].S = q[i].S;
+			s.p[i].phase = (status)q[i].phase;
+			s.p[i].id = q[i].id;
+		}
+		s.bubbles.instance.assign(b, b + 3 * f->nBubbles);
+		s.stats.iceFraction = f->iceFraction;
+		s.stats.totalAir = f->totalAir;
+		s.stats.maxSpeed = f->maxSpeed;
+	}
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include "SPH.h"
+#include "Recording.h"
+#include "Thread.h"
+
+// plays a recording into the viewer's SPH instance instead of simulating.
+// Particles of the current frame are copied in directly; textures and
+// contours are rebuilt on a worker thread with its own instance and handed
+// over by swapping buffers, so seeking never stalls the display. While the
+// worker is busy the viewer keeps the last finished textures.
+class Replay
+{
+private:
+	Recording rec;
+	//work builds textures, ready holds the newest finished set
+	SPH work, ready;
+	Mutex lock;
+	Signal wake;
+	Thread worker;
+	int requested, built, shown;
+	//ready holds a set the viewer has not taken yet
+	bool fresh;
+	bool quit;
+	double cursor;
+
+	static void run(void *self)
+	{
+		((Replay *)self)->loop();
+	}
+
+	void loop(void)
+	{
+		int k;
+
+		for (;;) {
+			lock.lock();
+			while (!quit && requested == built) wake.wait(lock);
+			k = requested;
+			lock.unlock();
+			if (quit) break;
+
+			rec.load(k, work);
+			work.regenerate();
+
+			lock.lock();
+			work.swapRender(ready);
+			built = k;
+			fresh = true;
+			lock.unlock();
+		}
+	}
+
+public:
+	//recorded frames per display update, negative plays backwards
+	double speed;
+	bool playing;
+
+	Replay()
+	{
+		requested = built = shown = -1;
+		fresh = quit = false;
+		cursor = 0.0;
+		speed = 1.0;
+		playing = true;
+	}
+
+	~Replay()
+	{
+		close();
+	}
+
+	bool open(const char *fileName)
+	{
+		if (!rec.open(fileName) || rec.frames() == 0) return false;
+		work.param = rec.param();
+		work.init(32);
+		requested = built = shown = -1;
+		fresh = quit = false;
+		cursor = 0.0;
+		return worker.start(run, this);
+	}
+
+	void close(void)
+	{
+		lock.lock();
+		quit = true;
+		wake.wake();
+		lock.unlock();
+		worker.join();
+		rec.close();
+	}
+
+	const SimParams &param(void)
+	{
+		return rec.param();
+	}
+
+	int frames(void)
+	{
+		return rec.frames();
+	}
+
+	int frame(void)
+	{
+		return (int)cursor;
+	}
+
+	int step(void)
+	{
+		return rec.frame(frame())->step;
+	}
+
+	void seek(double k)
+	{
+		if (k < 0.0) k = 0.0;
+		if (k > rec.frames() - 1) k = rec.frames() - 1;
+		cursor = k;
+	}
+
+	// move the cursor and bring s up to date: particles of the current
+	// frame, and the newest textures the worker has finished
+	void show(SPH &s)
+	{
+		int k;
+
+		if (playing) seek(cursor + speed);
+		k = frame();
+		if (k != shown) {
+			rec.load(k, s);
+			shown = k;
+			lock.lock();
+			requested = k;
+			wake.wake();
+			lock.unlock();
+		}
+
+		lock.lock();
+		if (fresh) {
+			s.swapRender(ready);
+			fresh = false;
+		}
+		lock.unlock();
+	}
+};
+
+#endif
@@ -4,563 +4,782 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
 #include "const.h"
 #include "Point.h"
 #include "particle.h"
 #include "GridData.h"
+#include "Bubbles.h"
+#include "KernelTable.h"
+#include "Params.h"
+#include "Boundary.h"
+#include "BoundaryParticles.h"
 #include "util.h"
-
-typedef Particle *Ptr;
+#include "TaskGraph.h"
+#include "FieldTiles.h"
+#include "Emitter.h"
+#include "FluidStep.h"
+#include "EventLog.h"
+#include "Metrics.h"
+
+// precision of the solver core, FloatPrecision unless the build says
+// otherwise; particles are stored as floats either way
+#ifndef SPH_PRECISION
+#define SPH_PRECISION FloatPrecision
+#endif
+
+// sums over every process of a distributed run. Each process splats its
+// own particles onto the heat grid, and the sums of all of them make the
+// one grid every process steps the same way
+class GridReducer
+{
+public:
+	virtual ~GridReducer() {}
+	virtual void sum(float *v, int n) = 0;
+};
 
 class SPH
 {
+public:
+	typedef FluidStep<SPH_PRECISION, 2, Particle> Fluid;
+	typedef Fluid::Core Core;
+
+	struct SweepStats
+	{
+		float totalAir;
+		float iceFraction;
+		float maxSpeed;
+		float kinetic;
+		float densityError;
+		float mass;
+	};
+
+	// fields interpolated at a point: density summed over the kernel, the
+	// rest averaged by particle volume, ice as the frozen share of it.
+	// weight is the volume the average covers, 0 where no particle reaches
+	struct FieldSample
+	{
+		float density, weight;
+		Point2f vel;
+		float T, S, ice;
+	};
+
 private:
-	int tLen, tSize;
-	Particle **table;
-	Point2f pos0, vel0;
-	GridData Grid[50][50];
+	//cell table, kernels and the steps over them
+	Fluid fluid;
+	//owned particles sorted by cell, copied back over p
+	Particle *spare;
+	//index of each particle ID among the owned ones, -1 for none
+	std::vector<int> idToIndex;
+	unsigned int nextId;
+	//IDs of removed particles, handed out again before new ones
+	std::vector<unsigned int> freeIds;
+	int sinceSort;
+	//kill mask over the owned particles, cleared as they are removed
+	unsigned char *dead;
+	//survivors before each chunk, during a removal
+	std::vector<int> kept;
+	int *airTarget;
+	//baked wall kernel gradient at each particle, from the density pass
+	Point2f *wallGrad;
+	float kr, kr2, kr3, kr4;
+	GridData Grid[GRID_RES][GRID_RES];
+	//per chunk sums of the advance sweep
+	std::vector<SweepStats> partial;
+	TaskGraph graph;
+	//seconds spent in each stage since the last measure, when timing
+	double stageSeconds[STAGES];
+	int timedSteps;
+	//per chunk particle to grid sums: weight, weighted temperature and ice
+	//weight, GRID_RES * GRID_RES of each
+	std::vector<float> heatSums;
+	//query points of a batch sorted by cell: the queries of cell c are
+	//queryIndex[queryStart[c]] up to queryIndex[queryStart[c + 1] - 1]
+	std::vector<int> queryKey, queryStart, queryIndex;
+
+	// table column or row of a coordinate, points outside the domain going
+	// to the nearest edge
+	inline int clampCell(float v)
+	{
+		int c = (int)floor(v / kr);
+		return c < 0 ? 0 : (c > fluid.tLen - 1 ? fluid.tLen - 1 : c);
+	}
+
+	// counting sort of n query points by cell, as Fluid::countCells does particles
+	void binQueries(const Point2f *pos, int n)
+	{
+		int i;
+
+		queryKey.resize(n);
+		queryIndex.resize(n);
+		queryStart.assign(fluid.tSize + 1, 0);
+		for (i = 0; i < n; i++) {
+			queryKey[i] = clampCell(pos[i].x) + clampCell(pos[i].y) * fluid.tLen;
+			queryStart[queryKey[i] + 1]++;
+		}
+		for (i = 0; i < fluid.tSize; i++) queryStart[i + 1] += queryStart[i];
+		for (i = 0; i < n; i++) queryIndex[queryStart[queryKey[i]]++] = i;
+		for (i = fluid.tSize; i > 0; i--) queryStart[i] = queryStart[i - 1];
+		queryStart[0] = 0;
+	}
+
+	// fields at the nq points pos[q[0]] up to pos[q[nq - 1]], all in cell c,
+	// into the same places of out; each neighbour is read once for them all
+	void sampleCell(int c, const int *q, int nq, const Point2f *pos, FieldSample *out)
+	{
+		int a, n, y, from, to, x0 = c % fluid.tLen, y0 = c / fluid.tLen;
+		float w, v;
+
+		for (a = 0; a < nq; a++) {
+			FieldSample &s = out[q[a]];
+			s.density = s.weight = s.T = s.S = s.ice = 0.0f;
+			s.vel.Zero();
+		}
+		for (y = y0 - 1; y <= y0 + 1; y++) {
+			if (y < 0 || y > fluid.tLen - 1) continue;
+			rowRun(x0, y, from, to);
+			for (n = from; n < to; n++) {
+				const Particle &o = p[fluid.cellIndex[n]];
+				for (a = 0; a < nq; a++) {
+					w = WPoly6(pos[q[a]] - o.pos);
+					if (w == 0.0f) continue;
+					FieldSample &s = out[q[a]];
+					s.density += param.mass * w;
+					if (o.dens < EPS) continue;
+					v = param.mass / o.dens * w;
+					s.weight += v;
+					s.vel += v * o.vel;
+					s.T += v * o.T;
+					s.S += v * o.S;
+					if (o.phase == ice) s.ice += v;
+				}
+			}
+		}
+		for (a = 0; a < nq; a++) {
+			FieldSample &s = out[q[a]];
+			if (s.weight <= 0.0f) continue;
+			s.vel /= s.weight;
+			s.T /= s.weight;
+			s.S /= s.weight;
+			s.ice /= s.weight;
+		}
+	}
 
 	void buildTable(void)
 	{
-		int i, x, y, index;
+		fluid.countCells(p, pNum + gNum);
+		reindex();
+	}
 
-		for (i = 0; i < tSize; i++) table[i] = NULL;
+	// where each owned particle now is, after anything that moved them
+	void reindex(void)
+	{
+		int i;
+
+		std::fill(idToIndex.begin(), idToIndex.end(), -1);
 		for (i = 0; i < pNum; i++) {
-			x = (int)(p[i].pos.x / KR);
-			y = (int)(p[i].pos.y / KR);
-			index = x + y * tLen;
-			if (table[index] == NULL) {
-				table[index] = &p[i];
-				p[i].next = NULL;
-			} 
-			else {
-				p[i].next = table[index];
-				table[index] = &p[i];
-			}
+			if (p[i].id >= idToIndex.size()) idToIndex.resize(p[i].id + 1, -1);
+			idToIndex[p[i].id] = i;
+			if (p[i].id >= nextId) nextId = p[i].id + 1;
 		}
 	}
 	
-	void buildGrid(void)
+	// the four grid nodes around pos and their bilinear weights; nodes sit
+	// at the cell centres and the outer half cells lean on the edge nodes
+	inline int gridWeights(const Point2f &pos, float *w)
 	{
-		int i, j, x, y, index;
+		float gx = pos.x / gridSize - 0.5f, gy = pos.y / gridSize - 0.5f, fx, fy;
+		int x = (int)floor(gx), y = (int)floor(gy);
+
+		if (x < 0) x = 0;
+		else if (x > GRID_RES - 2) x = GRID_RES - 2;
+		if (y < 0) y = 0;
+		else if (y > GRID_RES - 2) y = GRID_RES - 2;
+		fx = gx - x;
+		fy = gy - y;
+		fx = fx < 0.0f ? 0.0f : (fx > 1.0f ? 1.0f : fx);
+		fy = fy < 0.0f ? 0.0f : (fy > 1.0f ? 1.0f : fy);
+		w[0] = (1.0f - fx) * (1.0f - fy);
+		w[1] = fx * (1.0f - fy);
+		w[2] = (1.0f - fx) * fy;
+		w[3] = fx * fy;
+		return x * GRID_RES + y;
+	}
 
-		//clean
-		for(i = 0; i < 50; i++)
-			for(j = 0; j < 50; j++)
-			{
-				Grid[i][j].T = Twater;
-				Grid[i][j].DT = 0.0f;
-				Grid[i][j].pv.clear();
-				Grid[i][j].flagOfData = false;
+	// particle to grid: weight, weighted temperature and ice weight of
+	// particles [begin, end) into the sums of chunk c. Each chunk has its own
+	// sums, so chunks run at once and add up the same in any order
+	void splatHeat(int begin, int end, int c)
+	{
+		int i, k, base, n = GRID_RES * GRID_RES;
+		int corner[4] = {0, GRID_RES, 1, GRID_RES + 1};
+		float w[4], frozen, *sw = &heatSums[3 * n * c], *st = sw + n, *si = st + n;
+
+		memset(sw, 0, 3 * n * sizeof(float));
+		for (i = begin; i < end; i++) {
+			if (p[i].phase == bubble) continue;
+			base = gridWeights(p[i].pos, w);
+			frozen = p[i].phase == ice ? 1.0f : 0.0f;
+			for (k = 0; k < 4; k++) {
+				sw[base + corner[k]] += w[k];
+				st[base + corner[k]] += w[k] * p[i].T;
+				si[base + corner[k]] += w[k] * frozen;
 			}
+		}
+	}
 
-		for (i = 0; i < pNum; i++) {
-			x = (int)(p[i].pos.x/gridSize);
-			y = (int)(p[i].pos.y/gridSize);
-			//printf("px: %f, py: %f\n", p[i].pos.x, p[i].pos.y);
-			//printf("x: %d, y: %d\n", x, y);
-			if(p[i].pos.x != 1.0f && p[i].pos.y != 1.0f)
-				Grid[x][y].pv.push_back(&p[i]);
-			else 
-				p[i].phase = ice;
-
+	// chunk sums of grid nodes [begin, end) into the grid, in chunk order
+	void gatherGrid(int begin, int end)
+	{
+		int c, k, n = GRID_RES * GRID_RES, chunks = (int)heatSums.size() / (3 * n);
+		float w, t, wIce;
+
+		for (k = begin; k < end; k++) {
+			w = t = wIce = 0.0f;
+			for (c = 0; c < chunks; c++) {
+				w += heatSums[3 * n * c + k];
+				t += heatSums[3 * n * c + n + k];
+				wIce += heatSums[3 * n * c + 2 * n + k];
+			}
+			GridData &g = Grid[k / GRID_RES][k % GRID_RES];
+			g.w = w;
+			g.wIce = wIce;
+			g.flagOfData = w > EPS;
+			g.T = g.flagOfData ? t / w : param.Twater;
+			g.DT = 0.0f;
 		}
+	}
 
-		for(i = 0; i < 50; i++)
-			for(j = 0; j < 50; j++)
-				if(Grid[i][j].pv.size() != 0)
-					Grid[i][j].flagOfData = true;
+	// one set of sums per TASK_GRAIN particles, at least one
+	int heatChunks(void)
+	{
+		int chunks = (pNum + TASK_GRAIN - 1) / TASK_GRAIN;
+
+		heatSums.assign(3 * GRID_RES * GRID_RES * (chunks > 0 ? chunks : 1), 0.0f);
+		return chunks;
+	}
+
+	// chunk sums folded into the first chunk's in chunk order, then summed
+	// over the processes; gatherGrid then sees a single chunk
+	void reduceHeat(void)
+	{
+		int c, k, n = 3 * GRID_RES * GRID_RES, chunks = (int)heatSums.size() / n;
+
+		for (c = 1; c < chunks; c++)
+			for (k = 0; k < n; k++) heatSums[k] += heatSums[c * n + k];
+		heatSums.resize(n);
+		gridReducer->sum(&heatSums[0], n);
 	}
 
+	void buildGrid(void)
+	{
+		int i, chunks = heatChunks();
+
+#pragma omp parallel for schedule(static)
+		for (i = 0; i < chunks; i++)
+			splatHeat(i * TASK_GRAIN, (i + 1) * TASK_GRAIN < pNum ? (i + 1) * TASK_GRAIN : pNum, i);
+		if (gridReducer != NULL) reduceHeat();
+#pragma omp parallel for schedule(static)
+		for (i = 0; i < GRID_RES; i++)
+			gatherGrid(i * GRID_RES, (i + 1) * GRID_RES);
+	}
+
+	struct Poly6Fn
+	{
+		SPH *s;
+		Poly6Fn(SPH *sph) : s(sph) {}
+		float operator()(const Point2f &r) { return s->WPoly6(r); }
+	};
+
+	struct SpikyGradFn
+	{
+		SPH *s;
+		SpikyGradFn(SPH *sph) : s(sph) {}
+		Point2f operator()(const Point2f &r) { return s->WSpikyGrad(r); }
+	};
+
+	struct ViscosityLapFn
+	{
+		SPH *s;
+		ViscosityLapFn(SPH *sph) : s(sph) {}
+		float operator()(const Point2f &r) { return s->WViscosityLap(r); }
+	};
+
 	inline float WPoly6(const Point2f &r)
 	{
 		float r2 = r.LengthSquared();
-		if (r2 > KR2) return 0.0f;
-		float a = KR2 - r2;
-		return WPoly6Scale * CUBE(a);
+		if (r2 > kr2) return 0.0f;
+		return tabulated ? fluid.core.tPoly6(r2) : fluid.core.poly6(r2);
 	}
 
 	inline Point2f WPoly6Grad(const Point2f &r)
 	{
 		float r2 = r.LengthSquared();
-		if (r2 > KR2) return Point2f(0.0f, 0.0f);
-		float a = KR2 - r2;
-		float b = -6.0f * WPoly6Scale * SQ(a);
-		return Point2f(b * r.x, b * r.y); 
+		if (r2 > kr2) return Point2f(0.0f, 0.0f);
+		return (tabulated ? fluid.core.tPoly6Grad(r2) : fluid.core.poly6Grad(r2)) * r;
 	}
 
 	inline float WSpiky(const Point2f &R)
 	{
 		float r2 = R.LengthSquared();
-		if (r2 > KR2) return 0.0f;
-		float a = KR - sqrt(r2);
-		return WSpikyScale * CUBE(a);
+		if (r2 > kr2) return 0.0f;
+		return tabulated ? fluid.core.tSpiky(r2) : fluid.core.spiky(r2);
 	}
 
 	inline Point2f WSpikyGrad(const Point2f &R)
 	{
 		float r2 = R.LengthSquared();
-		if (r2 > KR2) return Point2f(0.0f, 0.0f);
-		if (r2 < EPS) r2 = EPS;
-		float r = sqrt(r2);
-		float a = -3.0f * WSpikyScale * (KR - r) * (KR - r) / r;
-		return Point2f(a * R.x, a * R.y);
+		if (r2 > kr2) return Point2f(0.0f, 0.0f);
+		return (tabulated ? fluid.core.tSpikyGrad(r2) : fluid.core.spikyGrad(r2)) * R;
 	}
 
 	inline float WViscosity(const Point2f &R)
 	{
 		float r2 = R.LengthSquared();
-		if (r2 > KR2) return 0.0f;
-		if (r2 < EPS) r2 = EPS;
-		float r = sqrt(r2);
-		float r3 = r * r * r;
-		return WViscosityScale * (((-r3 / (2.0f * KR3)) + (r2 / KR2) + KR / (2.0f * r)) - 1.0f);
+		if (r2 > kr2) return 0.0f;
+		return tabulated ? fluid.core.tViscosity(r2) : fluid.core.viscosity(r2);
 	}
 
 	inline float WViscosityLap(const Point2f &R)
 	{
 		float r2 = R.LengthSquared();
-		if (r2 > KR2) return 0.0f;
-		float r = sqrt(r2);
-		return WViscosityScale * (6.0f / KR3) * (KR - r);
+		if (r2 > kr2) return 0.0f;
+		return tabulated ? fluid.core.tViscosityLap(r2) : fluid.core.viscosityLap(r2);
 	}
 
 	inline float WLucy(const Point2f &R)
 	{
 		float r2 = R.LengthSquared();
-		if (r2 > KR2) return 0.0f;
-		float r = sqrt(r2);
-		float a = (1.0f + 3.0f * r / KR) * CUBE(1 - r / KR);
-		return WLucyScale * a;
+		if (r2 > kr2) return 0.0f;
+		return tabulated ? fluid.core.tLucy(r2) : fluid.core.lucy(r2);
 	}
 
 	inline Point2f WLucyGrad(const Point2f &R)
 	{
 		float r2 = R.LengthSquared();
-		if (r2 > KR2) return Point2f(0.0f, 0.0f);
-		float r = sqrt(r2);
-		float a = -12.0f * (KR2 - 2.0f * r * KR + r2) / KR4;
-		return R * a;
-	}
-
-	void normalizeKernels()
-	{
-		int i, j, n = 1000;
-
-		float xmin = -KR;
-		float ymin = -KR;
-		float xmax = KR;
-		float ymax = KR;
-		float dx = (xmax - xmin) / n;
-		float dy = (ymax - ymin) / n;
-		float dA = dx * dy;
-		float totalPoly6 = 0.0f;
-		float totalSpiky = 0.0f;
-		float totalViscosity = 0.0f;
-		float totalLucy = 0.0f;
-
-		WPoly6Scale = 1.0f;
-		WSpikyScale = 1.0f;
-		WViscosityScale = 1.0f;
-		WLucyScale = 1.0f;
-
-		for (i = 0 ; i < n ; i++) {
-			for (j = 0 ; j < n ; j++) {
-				Point2f r(xmin + i * dx, ymin + j * dy);
-				totalPoly6 += WPoly6(r) * dA;
-				totalSpiky += WSpiky(r) * dA;
-				totalViscosity += WViscosity(r) * dA;
-				totalLucy += WLucy(r) * dA;
-			}
-		}
+		if (r2 > kr2) return Point2f(0.0f, 0.0f);
+		return (tabulated ? fluid.core.tLucyGrad(r2) : fluid.core.lucyGrad(r2)) * R;
+	}
 
-		WPoly6Scale = 1.0f / totalPoly6;
-		WSpikyScale = 1.0f / totalSpiky;
-		WViscosityScale = 1.0f / totalViscosity;
-		WLucyScale = 1.0f / totalLucy;
+	// first and last + 1 position in cellIndex of the cells beside and
+	// including cell x of row y, which are one run
+	inline void rowRun(int x, int y, int &from, int &to)
+	{
+		from = fluid.cellStart[(x > 0 ? x - 1 : 0) + y * fluid.tLen];
+		to = fluid.cellStart[(x < fluid.tLen - 1 ? x + 2 : fluid.tLen) + y * fluid.tLen];
 	}
 
-	void computeDP(void)
+	// density and pressure of a particle from its kernel sum and the walls
+	struct DensityDone
 	{
-		int i, j, x0, y0, x, y;
-		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
-		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
-		Point2f r;
-		Particle *iter;
+		SPH *s;
+		DensityDone(SPH *sph) : s(sph) {}
+		void operator()(int i, Core::Accum sum) const
+		{
+			Particle &q = s->p[i];
 
-		for (i = 0; i < pNum; i++) {
-			p[i].dens = 0.0f;
-			x0 = (int)(p[i].pos.x / KR);
-			y0 = (int)(p[i].pos.y / KR);
-			for (j = 0; j < 9; j++) {
-				x = x0 + dx[j];
-				y = y0 + dy[j];
-				if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-				iter = table[x + y * tLen];
-				while (iter != NULL) {
-					if (iter != &p[i]) {
-						r = p[i].pos - iter->pos;
-						p[i].dens += WPoly6(r);
-					}
-					iter = iter->next;
-				}
-			}
-			if (p[i].dens < EPS) p[i].dens = DEFAULT_DENSITY;
-			p[i].dens *= MASS;
-			p[i].pressure = GAS_CONSTANT * (CUBE(p[i].dens / DEFAULT_DENSITY) - 1.0f);
+			q.dens = (float)(sum + s->walls.field(q.pos, s->wallGrad[i]));
+			if (q.dens < EPS) q.dens = s->param.restDensity;
+			q.dens *= s->param.mass;
+			q.pressure = s->param.gasConstant * (CUBE(q.dens / s->param.restDensity) - 1.0f);
 		}
+	};
+
+	// density and pressure of the owned particles in cells [begin, end)
+	void computeDP(int begin, int end)
+	{
+		fluid.density(p, pNum, begin, end, tabulated, DensityDone(this));
 	}
 
-	void computeForce(void)
+	// particles conduct heat while freezing when the parameters ask for it
+	inline bool conducting(void)
 	{
-		int i, j, x0, y0, x, y;
-		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
-		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
-		Point2f r, ap, av, g(0.0f, -GRAVITY);
-		Particle *iter;
+		return freeze && param.conduction != 0;
+	}
 
-		for (i = 0; i < pNum; i++) {
-			ap.Zero();
-			av.Zero();
-			x0 = (int)(p[i].pos.x / KR);
-			y0 = (int)(p[i].pos.y / KR);
-			for (j = 0; j < 9; j++) {
-				x = x0 + dx[j];
-				y = y0 + dy[j];
-				if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-				iter = table[x + y * tLen];
-				while (iter != NULL) {
-					if (iter != &p[i]) {
-						r = p[i].pos - iter->pos;
-						ap -= ((p[i].pressure + iter->pressure) / iter->dens) * WSpikyGrad(r);
-						av += (WViscosityLap(r) / iter->dens) * (iter->vel - p[i].vel);
-					}
-					iter = iter->next;
-				}
+	// acceleration of a particle from its neighbour sums and the walls,
+	// and with conduction its temperature rate from the same neighbours and
+	// Laplacian kernel as the viscosity; the walls and air particles hold
+	// Tair
+	struct ForceDone
+	{
+		SPH *s;
+		bool conduct;
+		ForceDone(SPH *sph) : s(sph), conduct(sph->conducting()) {}
+		void operator()(int i, const Core::Sums &sums, int a) const
+		{
+			float heat;
+			Point2f ap((float)sums.ap[0][a], (float)sums.ap[1][a]), av((float)sums.av[0][a], (float)sums.av[1][a]);
+			Particle &q = s->p[i];
+			const SimParams &param = s->param;
+
+			//walls mirror the particle's own pressure, never pulling it in
+			if (q.pressure > 0.0f)
+				ap -= (2.0f * q.pressure / param.restDensity) * s->wallGrad[i];
+			q.acc = 0.5f * ap + param.viscosity * av + Point2f(0.0f, -param.gravity);
+			if (conduct) {
+				heat = param.mass * (float)sums.heat[a] + (param.mass / param.restDensity) * s->walls.laplacian(q.pos) * (param.Tair - q.T);
+				q.dT = param.conductivity * (q.phase == ice ? param.cThermalIce : param.cThermalWater) * heat;
 			}
-			p[i].acc = 0.5f * ap + VISCOSITY * av + g;
 		}
+	};
+
+	// forces on the owned particles in cells [begin, end)
+	void computeForce(int begin, int end)
+	{
+		fluid.force(p, pNum, begin, end, tabulated, ForceDone(this));
 	}
 	
-	//heat transfer
-	void transferHeat(void)
+	inline void changePhase(Particle &q, status to)
 	{
-		/*int i, j, x0, y0, x, y;
-		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
-		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
-		Point2f r, ap, av, g(0.0f, -GRAVITY);
-		//
-		float detaHeat(0.0f);
-		float cThermal(0.0f);
-
-		Particle *iter;
+		if (events != NULL && q.phase != to) events->log(stepCount, q.id, q.phase, to, q.T, q.S, q.pos);
+		q.phase = to;
+	}
 
-		for (i = 0; i < pNum; i++) {
-			ap.Zero();
-			av.Zero();
-			x0 = (int)(p[i].pos.x / KR);
-			y0 = (int)(p[i].pos.y / KR);
-
-			if(p[i].phase == water)
-				cThermal = cThermalWater;
-			else
-				cThermal = cThermalIce;
-
-			for (j = 0; j < 9; j++) {
-				x = x0 + dx[j];
-				y = y0 + dy[j];
-				if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-				iter = table[x + y * tLen];
-				while (iter != NULL) {
-					if (iter != &p[i]) {
-						r = p[i].pos - iter->pos;
-						//ap -= ((p[i].pressure + iter->pressure) / iter->dens) * WSpikyGrad(r);
-						detaHeat += cThermal * (WViscosityLap(r) / iter->dens) * (iter->T - p[i].T);
-						if(detaHeat!= 0.0f)
-						printf("detaHeat: %f\n",detaHeat);
-					}
-					iter = iter->next;
-				}
+	// grid to particle for particles [begin, end): FLIP adds the grid's
+	// change to each particle's own temperature, PIC takes the grid's value,
+	// and HEAT_FLIP blends the two
+	void heatParticles(int begin, int end)
+	{
+		int i, k, base;
+		int corner[4] = {0, GRID_RES, 1, GRID_RES + 1};
+		float w[4], pic, flip;
+
+		for (i = begin; i < end; i++) {
+			if (p[i].phase == bubble) continue;
+			base = gridWeights(p[i].pos, w);
+			pic = flip = 0.0f;
+			for (k = 0; k < 4; k++) {
+				const GridData &g = Grid[(base + corner[k]) / GRID_RES][(base + corner[k]) % GRID_RES];
+				pic += w[k] * g.T;
+				flip += w[k] * g.DT;
 			}
-			p[i].T = p[i].T + detaHeat;
-			if(p[i].phase == water && p[i].T <= Tfreeze)
-				p[i].phase = ice;
-		}*/
+			p[i].T = (1.0f - HEAT_FLIP) * pic + HEAT_FLIP * (p[i].T + flip);
+			if (p[i].phase == water && p[i].T <= param.Tfreeze)
+				changePhase(p[i], ice);
+		}
+	}
 
-		//
-		for(int i = 0; i < 50; i++)
-			for(int j = 0; j < 50; j++)
-			{
-				Grid[i][j].T += Grid[i][j].DT;
-				//if(Grid[i][j].T > 0)
-				//printf("T of (%d,%d): %f\n", i, j, Grid[i][j].T);
-				for (std::vector<Particle *>::iterator it = Grid[i][j].pv.begin() ; it != Grid[i][j].pv.end(); ++it)
-				{
-					(*it)->T = Grid[i][j].T;
-					if((*it)->phase == water && (*it)->T <= Tfreeze)
-						(*it)->phase = ice;
-				}
-			}
+	void stepGrid(void)
+	{
+		int i, j;
 
-		//bilinear interpolation
-		float x1,  f_x1,  g_x1,  x2,  f_x2,
-	 g_x2,  x,  y1,  y2,  y;
+		for (i = 0; i < GRID_RES; i++)
+			for (j = 0; j < GRID_RES; j++)
+				Grid[i][j].T += Grid[i][j].DT;
+	}
 
-		for(int i = 0; i < 50; i++)
-			for(int j = 0; j < 50; j++)
-				if(Grid[i][j].flagOfData)
-			{
-				x1 = Grid[i][j].pos.x;
-				x2 = Grid[i][j].pos.y;
+	//heat transfer
+	void transferHeat(void)
+	{
+		int i;
 
-				//bilinearInterpolation();
-			}
+		stepGrid();
+#pragma omp parallel for schedule(static)
+		for (i = 0; i < pNum; i += TASK_GRAIN)
+			heatParticles(i, i + TASK_GRAIN < pNum ? i + TASK_GRAIN : pNum);
 
 	}
 
 
-	//
-	void updateDissolvedAir(void)
+	// nearest particle to pos accepted by pred within the 3x3 cell
+	// neighbourhood
+	template <class Pred>
+	Particle *nearestParticle(const Point2f &pos, Pred pred)
 	{
-		int i, j, x0, y0, x, y;
-		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
-		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
-		Point2f r;
+		int i;
+		float d2;
 
-		Particle *iter, *nearest;
-		
-		float deltaDpi = 0.0f, deltaDpj = 0.0f, temp = 0.0f;
-		float W = 0.0f;
-		float sumOfW = 0.0f;
-		float rMin = 10.0f;
-		for (i = 0; i < pNum; i++) {
-			
-			if(p[i].phase != ice || p[i].S == 0.0f) continue;
-
-			sumOfW = 0.0f;
-			temp = 0.0f;
-			x0 = (int)(p[i].pos.x / KR);
-			y0 = (int)(p[i].pos.y / KR);
-
-			/*for (j = 0; j < 9; j++) {
-				x = x0 + dx[j];
-				y = y0 + dy[j];
-				if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-				iter = table[x + y * tLen];
-				
-				while (iter != NULL) {
-					if(iter->phase == water)
-					if (iter != &p[i]) {
-						r = p[i].pos - iter->pos;
-						printf("r.length: %f\n",r.Length());
-						W = 1/r.Length();
-						sumOfW += W;
-						temp += W * p[i].S;
-						//if(detaAir == 0.0)
-						//printf("detaAir: %f\n",detaAir);
-						//printf("iter->S: %f, p[i].S: %f\n",iter->S,p[i].S);
-					}
-					iter = iter->next;
-				}
-				temp = temp/sumOfW;
-				if(temp > p[i].S)
-					deltaDpi = p[i].S;
-				else
-					deltaDpi = temp;
-				//printf("deltaDpi: %f\n", deltaDpi);
-			}
-			//
-			for (j = 0; j < 9; j++) {
-				x = x0 + dx[j];
-				y = y0 + dy[j];
-				if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-				iter = table[x + y * tLen];
-				
-				while (iter != NULL) {
-					if(iter->phase == water)
-					if (iter != &p[i]) {
-						r = p[i].pos - iter->pos;
-						W = 1/r.Length();
-						deltaDpj = W * deltaDpi / sumOfW;
-						iter->S += deltaDpj;
-						p[i].S -= deltaDpj;
-						//if(detaAir == 0.0)
-						//printf("detaAir: %f\n",detaAir);
-						//printf("iter->S: %f, p[i].S: %f\n",iter->S,p[i].S);
-					}
-					iter = iter->next;
-				}
+		return nearest(pos, 1, pred, &i, &d2, 1) > 0 ? &p[i] : NULL;
+	}
 
-			}*/
-
-			//only consider nearest point
-			nearest = NULL;
-			for (j = 0; j < 9; j++) {
-				x = x0 + dx[j];
-				y = y0 + dy[j];
-				if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-				iter = table[x + y * tLen];
-				
-				while (iter != NULL) {
-					if(iter->phase == water)
-					if (iter != &p[i]) {
-						r = p[i].pos - iter->pos;
-						//printf("r.length: %f\n",r.Length());
-						if(r.Length() < rMin)
-						{
-							rMin = r.Length();
-							nearest = iter;
-						}
-					}
-					iter = iter->next;
-				}
-			}
-			if(nearest)
-			{
-				nearest->S += p[i].S;
-				p[i].S = 0.0f;
+	//ghosts are read-only, so only owned particles take air
+	struct OtherWater
+	{
+		const Particle *self, *end;
+		OtherWater(const Particle *s, const Particle *e) : self(s), end(e) {}
+		bool operator()(const Particle *q) const { return q != self && q < end && q->phase == water; }
+	};
+
+	// dissolved air of ice particles moves to the nearest water particle.
+	// Targets are picked in parallel, nothing is written but airTarget[i]
+	void pickAirTargets(int begin, int end)
+	{
+		int i;
+		Particle *nearest;
 
-				if(nearest->S > 1.3)
-				{
-					nearest->phase = bubble;
-					nearest->volume = nearest->S;
-				}
-			}
+		for (i = begin; i < end; i++) {
+			airTarget[i] = -1;
+			if (p[i].phase != ice || p[i].S == 0.0f) continue;
+			nearest = nearestParticle(p[i].pos, OtherWater(&p[i], p + pNum));
+			if (nearest) airTarget[i] = (int)(nearest - p);
 		}
 	}
-	void checkAir()
+
+	// accumulate in index order, so several ice particles sharing a target
+	// never race and the result does not depend on the thread count
+	void moveAir(void)
 	{
-		int i;
+		int i, j;
 
 		for (i = 0; i < pNum; i++) {
-		if (p[i].pos.x < 0.01f) {
-			p[i].phase = bubble;
-			p[i].T = Tair;
-		}
-		else if (p[i].pos.x > 0.99f) {
-			p[i].phase = bubble;
-			p[i].T = Tair;
-		}
-		if (p[i].pos.y < 0.01f) {
-			p[i].phase = bubble;
-			p[i].T = Tair;
-		}
-		else if (p[i].pos.y > 0.99f) {
-			p[i].phase = bubble;
-			p[i].T = Tair;
-		}
+			j = airTarget[i];
+			if (j < 0) continue;
+			p[j].S += p[i].S;
+			p[i].S = 0.0f;
+			if (p[j].S > BUBBLE_THRESHOLD) {
+				if (events != NULL)
+					events->log(stepCount, p[j].id, water, bubble, p[j].T, p[j].S, p[j].pos, AIR_RELEASE, bubbles.count());
+				bubbles.add(p[j].pos, p[j].vel, p[j].S);
+				p[j].S = 0.0f;
+			}
 		}
-
 	}
 
-	void fixIce()
+	void updateDissolvedAir(void)
 	{
 		int i;
-		for (i = 0; i < pNum; i++) {
-			if(p[i].phase == ice)
-			{
-				p[i].vel.x = 0;
-				p[i].vel.y = 0;
-			}
-		}
+
+#pragma omp parallel for schedule(dynamic, 64)
+		for (i = 0; i < pNum; i += 64)
+			pickAirTargets(i, i + 64 < pNum ? i + 64 : pNum);
+		moveAir();
 	}
 
-	void integrate(void)
+	struct AnyParticle
+	{
+		bool operator()(const Particle *) const { return true; }
+	};
+
+	// a bubble touching ice is trapped, one with no particle in reach has
+	// left the water, and with removeAir one touching a wall is let out
+	void updateBubbles(void)
 	{
 		int i;
+		Particle *nearest;
+		Point2f n;
+
+		for (i = 0; i < bubbles.count(); i++) {
+			nearest = nearestParticle(bubbles.b[i].pos, AnyParticle());
+			if (nearest == NULL || (nearest->pos - bubbles.b[i].pos).LengthSquared() > kr2)
+				bubbles.burst(i);
+			else if (param.removeAir && !bubbles.b[i].trapped && boundary.sample(bubbles.b[i].pos, n) > -BubbleSystem::radius(bubbles.b[i].volume))
+				bubbles.burst(i);
+			else if (nearest->phase == ice)
+				bubbles.b[i].trapped = true;
+		}
+		bubbles.update(h);
+	}
 
-		for (i = 0; i < pNum; i++) {
-			p[i].vel += p[i].acc * h;
-			p[i].pos += p[i].vel * h;
+	// wall pressure inside a thin layer along the container, then projection
+	// out of the wall and reflection of the normal velocity; d and n come
+	// from the one distance field lookup the particle gets per step
+	inline void collide(Particle &q, float d, Point2f n)
+	{
+		float len, vn, layer = WALL_LAYER * kr;
+
+		if (d < -layer) return;
+		len = n.Length();
+		if (len < EPS) return;
+		n /= len;
+		q.vel -= (h * param.wallStiffness * (d + layer)) * n;
+		if (d > -WALL_MARGIN) {
+			q.pos -= (d + WALL_MARGIN) * n;
+			vn = q.vel.x * n.x + q.vel.y * n.y;
+			if (vn > 0.0f) q.vel -= ((1.0f + param.elasticity) * vn) * n;
 		}
 	}
 
-	void fixBoundary(void)
+	// everything after the forces in one pass: conduct and freeze, integrate,
+	// collide with the walls, pin ice and, with airContact set, turn
+	// particles touching the walls to air, reducing the step stats on the
+	// way; sums go to part, with the squared top speed in maxSpeed, the
+	// ice count in iceFraction, the sum of squared speeds in kinetic and
+	// the particle mass in mass
+	void advance(int begin, int end, SweepStats &part)
 	{
 		int i;
-		float bedding = 0.0f;
-		for (i = 0; i < pNum; i++) {
-			if (p[i].pos.x < 0.0f + bedding) {
-				p[i].pos.x = EPS;
-				p[i].vel.x = -p[i].vel.x * ELASTICITY;
-			}
-			else if (p[i].pos.x > 1.0f - bedding) {
-				p[i].pos.x = 1.0f - EPS;
-				p[i].vel.x = -p[i].vel.x * ELASTICITY;
+		float d, v2, e;
+		bool conduct = conducting();
+		Point2f n;
+
+		part.totalAir = part.iceFraction = part.maxSpeed = part.kinetic = part.densityError = part.mass = 0.0f;
+		for (i = begin; i < end; i++) {
+			Particle &q = p[i];
+			//compression only, the surface is always short of neighbours;
+			//a density gone to NaN counts as the worst
+			e = q.dens / param.restDensity - 1.0f;
+			if (e != e) e = FLT_MAX;
+			if (e > part.densityError) part.densityError = e;
+			if (conduct && q.phase != bubble) {
+				q.T += h * q.dT;
+				if (q.phase == water && q.T <= param.Tfreeze) changePhase(q, ice);
 			}
-			if (p[i].pos.y < 0.0f + bedding) {
-				p[i].pos.y = EPS;
-				p[i].vel.y = -p[i].vel.y * ELASTICITY;
+			if (q.phase == ice) {
+				q.vel.Zero();
+				part.iceFraction += 1.0f;
 			}
-			else if (p[i].pos.y > 1.0f - bedding) {
-				p[i].pos.y = 1.0f - EPS;
-				p[i].vel.y = -p[i].vel.y * ELASTICITY;
+			else Fluid::integrate(q, h);
+			//still clamped, the table must hold it until it is removed
+			if (param.openBoundary && (q.pos.x < 0.0f || q.pos.x > 1.0f || q.pos.y < 0.0f || q.pos.y > 1.0f))
+				dead[i] = 1;
+			//the distance field covers the unit square only, as the table does
+			Fluid::clampBox(q, param.elasticity);
+			d = boundary.sample(q.pos, n);
+			if (q.phase != ice) collide(q, d, n);
+			//particles touching the walls turn to air
+			if (airContact && d > -AIR_LAYER) {
+				changePhase(q, bubble);
+				q.T = param.Tair;
 			}
+			if (param.removeAir && q.phase == bubble) dead[i] = 1;
+			part.totalAir += q.S;
+			part.mass += param.mass;
+			v2 = q.vel.LengthSquared();
+			part.kinetic += v2;
+			if (v2 > part.maxSpeed) part.maxSpeed = v2;
 		}
 	}
 
-	void generateTexture(float * texture, float phase, float * color)
+	// partial sums in chunk order, so the stats do not depend on scheduling
+	void sumStats(int chunks)
 	{
-		int i, j, k, x0, y0, x, y;
-		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
-		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+		int i;
+		float air = 0.0f, nIce = 0.0f, v2max = 0.0f, v2sum = 0.0f, e = 0.0f, mass = 0.0f;
+
+		for (i = 0; i < chunks; i++) {
+			air += partial[i].totalAir;
+			mass += partial[i].mass;
+			nIce += partial[i].iceFraction;
+			v2sum += partial[i].kinetic;
+			if (partial[i].maxSpeed > v2max) v2max = partial[i].maxSpeed;
+			if (partial[i].densityError > e) e = partial[i].densityError;
+		}
+		stats.totalAir = air;
+		stats.iceFraction = pNum > 0 ? nIce / pNum : 0.0f;
+		stats.maxSpeed = sqrt(v2max);
+		stats.kinetic = 0.5f * param.mass * v2sum;
+		stats.densityError = e;
+		stats.mass = mass;
+	}
+
+	void advance(void)
+	{
+		int i, chunks = (pNum + TASK_GRAIN - 1) / TASK_GRAIN;
+
+		partial.resize(chunks);
+#pragma omp parallel for schedule(static)
+		for (i = 0; i < chunks; i++)
+			advance(i * TASK_GRAIN, (i + 1) * TASK_GRAIN < pNum ? (i + 1) * TASK_GRAIN : pNum, partial[i]);
+		sumStats(chunks);
+	}
+
+	//density of one phase as a single intensity channel, coloured by the shader;
+	//the dirty ones of tiles begin to end
+	void generateTexture(float * texture, float phase, FieldTiles &tiles, int begin, int end)
+	{
+		int i, j, t, n, from, to, x0, y0, y, i0, i1, j0, j1;
 		float delta = 1.0f / RENDER_SAMPLE;
-		float intensity, dens, *data;
+		float intensity, dens;
 		Point2f pos;
 		Particle *iter;
 
-		float max = 0.0f, min = 1e6f;
-		for (i = 0; i < RENDER_SAMPLE; i++) {
-			for (j = 0; j < RENDER_SAMPLE; j++) {
+		for (t = begin; t < end; t++) {
+			if (!tiles.dirty[t]) continue;
+			tiles.bounds(t, i0, i1, j0, j1);
+			for (i = i0; i < i1; i++) for (j = j0; j < j1; j++) {
 				dens = 0.0f;
 				pos.x = delta * i;
 				pos.y = delta * j;
-				x0 = (int)(pos.x / KR);
-				y0 = (int)(pos.y / KR);
-				for (k = 0; k < 9; k++) {
-					x = x0 + dx[k];
-					y = y0 + dy[k];
-					if (x < 0 || x > tLen - 1 || y < 0 || y > tLen - 1) continue;
-					iter = table[x + y * tLen];
-					while (iter != NULL) {
+				x0 = (int)(pos.x / kr);
+				y0 = (int)(pos.y / kr);
+				for (y = y0 - 1; y <= y0 + 1; y++) {
+					if (y < 0 || y > fluid.tLen - 1) continue;
+					rowRun(x0, y, from, to);
+					for (n = from; n < to; n++) {
+						iter = &p[fluid.cellIndex[n]];
 						if(iter->phase == phase)
 						dens += WPoly6(pos - iter->pos);
-						iter = iter->next;
 					}
 				}
-				intensity = MASS * dens / 500.0f;
+				intensity = param.mass * dens / 500.0f;
 				if (intensity > 1.0f) intensity = 1.0f;
-				data = &texture[4 * (i + (j * RENDER_SAMPLE))];
-				data[0] = color[0] * intensity;
-				data[1] = color[1] * intensity;
-				data[2] = color[2] * intensity;
-				data[3] = color[3] * intensity;
+				texture[i + j * RENDER_SAMPLE] = intensity;
+			}
+		}
+	}
+
+	// particles of a phase in a table cell next to one holding none of the
+	// phase lie on its surface. The field is below the isolevel beyond a
+	// kernel radius of its particles and above it well inside them, so the
+	// contour only runs through render cells within reach of surface table
+	// cells; they form the band. Surface particles are found by occupancy
+	// rather than by a density deficit or colour field gradient: it takes no
+	// neighbour pass and no tuned threshold, and it never drops a piece of
+	// contour, where a threshold can miss the rim of a small gap
+	void findBand(float phase, FieldTiles &tiles)
+	{
+		int i, k, x0, y0, x, y;
+		int dx[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
+		int dy[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+		std::vector<unsigned char> &cellHas = tiles.cellHas;
+
+		cellHas.assign(fluid.tSize, 0);
+		for (i = 0; i < pNum + gNum; i++)
+			if (p[i].phase == phase)
+				cellHas[(int)(p[i].pos.x / kr) + (int)(p[i].pos.y / kr) * fluid.tLen] = 1;
+
+		tiles.clearBand();
+		for (i = 0; i < fluid.tSize; i++) {
+			if (!cellHas[i]) continue;
+			x0 = i % fluid.tLen;
+			y0 = i / fluid.tLen;
+			for (k = 0; k < 9; k++) {
+				x = x0 + dx[k];
+				y = y0 + dy[k];
+				if (x < 0 || x > fluid.tLen - 1 || y < 0 || y > fluid.tLen - 1 || !cellHas[x + y * fluid.tLen]) break;
 			}
+			if (k < 9) tiles.markBand(x0 * kr - kr, y0 * kr - kr, x0 * kr + 2.0f * kr, y0 * kr + 2.0f * kr);
 		}
 	}
 
-	void marchingSquares(float * texture, Point2f * lineA, Point2f * lineB, int &nLine)
+	//where the isolevel crosses edge k of the cell at (i, j), from corner k
+	//to corner k + 1 counterclockwise
+	static Point2f crossing(const float *c, int i, int j, int k)
+	{
+		int l = (k + 1) % 4;
+		Point2f a((float)(i + (k == 1 || k == 2)) / RENDER_SAMPLE, (float)(j + (k >= 2)) / RENDER_SAMPLE);
+		Point2f b((float)(i + (l == 1 || l == 2)) / RENDER_SAMPLE, (float)(j + (l >= 2)) / RENDER_SAMPLE);
+
+		return (c[k] * a - c[l] * b) / (c[k] - c[l]);
+	}
+
+	//contour segments of the band cells of tile t; edges are interpolated
+	//only for the cells the contour crosses
+	void marchTile(float * texture, FieldTiles &tiles, int t)
 	{
-		int i, j, key, s;
+		int i, j, key, i0, i1, j0, j1;
 		float isolevel = 0.5f;
 		float c[4];
-		Point2f v[4], p[4];
-
-		s = 0;
-		for (i = 0; i < RENDER_SAMPLE - 1; i++) {
-			for (j = 0; j < RENDER_SAMPLE - 1; j++) {
-				c[0] = texture[4 * (i + j * RENDER_SAMPLE) + 3] - isolevel;
-				c[1] = texture[4 * (i + 1 + j * RENDER_SAMPLE) + 3] - isolevel;
-				c[2] = texture[4 * (i + 1 + (j + 1) * RENDER_SAMPLE) + 3] - isolevel;
-				c[3] = texture[4 * (i + (j + 1) * RENDER_SAMPLE) + 3] - isolevel;
-				v[0] = Point2f((float)i / RENDER_SAMPLE, (float)j / RENDER_SAMPLE);
-				v[1] = Point2f((float)(i + 1) / RENDER_SAMPLE, (float)j / RENDER_SAMPLE);
-				v[2] = Point2f((float)(i + 1) / RENDER_SAMPLE, (float)(j + 1) / RENDER_SAMPLE);
-				v[3] = Point2f((float)i / RENDER_SAMPLE, (float)(j + 1) / RENDER_SAMPLE);
-				p[0] = (c[0] * v[0] - c[1] * v[1]) / (c[0] - c[1]);
-				p[1] = (c[1] * v[1] - c[2] * v[2]) / (c[1] - c[2]);
-				p[2] = (c[2] * v[2] - c[3] * v[3]) / (c[2] - c[3]);
-				p[3] = (c[3] * v[3] - c[0] * v[0]) / (c[3] - c[0]);
+		std::vector<Point2f> &lineA = tiles.segA[t], &lineB = tiles.segB[t];
+
+		lineA.clear();
+		lineB.clear();
+		tiles.bounds(t, i0, i1, j0, j1);
+		if (i1 > RENDER_SAMPLE - 1) i1 = RENDER_SAMPLE - 1;
+		if (j1 > RENDER_SAMPLE - 1) j1 = RENDER_SAMPLE - 1;
+		for (i = i0; i < i1; i++) {
+			for (j = j0; j < j1; j++) {
+				if (!tiles.band[i + j * RENDER_SAMPLE]) continue;
+				c[0] = texture[i + j * RENDER_SAMPLE] - isolevel;
+				c[1] = texture[i + 1 + j * RENDER_SAMPLE] - isolevel;
+				c[2] = texture[i + 1 + (j + 1) * RENDER_SAMPLE] - isolevel;
+				c[3] = texture[i + (j + 1) * RENDER_SAMPLE] - isolevel;
 				key = (c[0] > 0 ? 1 : 0) + (c[1] > 0 ? 2 : 0) + (c[2] > 0 ? 4 : 0) + (c[3] > 0 ? 8 : 0);
 				switch (key) {
 					case 0:
@@ -568,84 +787,384 @@ private:
 						break;
 					case 1:
 					case 14:
-						lineA[s] = p[3];
-						lineB[s] = p[0];
-						s++;
+						lineA.push_back(crossing(c, i, j, 3));
+						lineB.push_back(crossing(c, i, j, 0));
 						break;
 					case 2:
 					case 13:
-						lineA[s] = p[0];
-						lineB[s] = p[1];
-						s++;
+						lineA.push_back(crossing(c, i, j, 0));
+						lineB.push_back(crossing(c, i, j, 1));
 						break;
 					case 4:
 					case 11:
-						lineA[s] = p[1];
-						lineB[s] = p[2];
-						s++;
+						lineA.push_back(crossing(c, i, j, 1));
+						lineB.push_back(crossing(c, i, j, 2));
 						break;
 					case 8:
 					case 7:
-						lineA[s] = p[2];
-						lineB[s] = p[3];
-						s++;
+						lineA.push_back(crossing(c, i, j, 2));
+						lineB.push_back(crossing(c, i, j, 3));
 						break;
 					case 3:
 					case 12:
-						lineA[s] = p[3];
-						lineB[s] = p[1];
-						s++;
+						lineA.push_back(crossing(c, i, j, 3));
+						lineB.push_back(crossing(c, i, j, 1));
 						break;
 					case 6:
 					case 9:
-						lineA[s] = p[0];
-						lineB[s] = p[2];
-						s++;
+						lineA.push_back(crossing(c, i, j, 0));
+						lineB.push_back(crossing(c, i, j, 2));
 						break;
 					case 5:
-						lineA[s] = p[3];
-						lineB[s] = p[0];
-						s++;
-						lineA[s] = p[1];
-						lineB[s] = p[2];
-						s++;
+						lineA.push_back(crossing(c, i, j, 3));
+						lineB.push_back(crossing(c, i, j, 0));
+						lineA.push_back(crossing(c, i, j, 1));
+						lineB.push_back(crossing(c, i, j, 2));
 						break;
 					case 10:
-						lineA[s] = p[0];
-						lineB[s] = p[1];
-						s++;
-						lineA[s] = p[2];
-						lineB[s] = p[3];
-						s++;
+						lineA.push_back(crossing(c, i, j, 0));
+						lineB.push_back(crossing(c, i, j, 1));
+						lineA.push_back(crossing(c, i, j, 2));
+						lineB.push_back(crossing(c, i, j, 3));
 						break;
 					default:
 						break;
 				}
 			}
 		}
-		
-		nLine = s;
+	}
+
+	void marchTiles(float * texture, FieldTiles &tiles, int begin, int end)
+	{
+		int t;
+
+		for (t = begin; t < end; t++)
+			if (tiles.cellsDirty(t)) marchTile(texture, tiles, t);
+	}
+
+	//the segments of every tile, in tile order
+	void gatherLines(FieldTiles &tiles, Point2f * lineA, Point2f * lineB, int &nLine)
+	{
+		int t, k;
+
+		nLine = 0;
+		for (t = 0; t < tiles.tiles(); t++) {
+			for (k = 0; k < (int)tiles.segA[t].size(); k++) {
+				lineA[nLine] = tiles.segA[t][k];
+				lineB[nLine] = tiles.segB[t][k];
+				nLine++;
+			}
+		}
+	}
+
+	// redraws the tiles of one phase's field and contour that particles of
+	// the phase have touched since it was last drawn
+	void redrawField(float * texture, float phase, FieldTiles &tiles, Point2f * lineA, Point2f * lineB, int &nLine)
+	{
+		if (tiles.scan(p, pNum + gNum, (int)phase, kr) == 0) return;
+		generateTexture(texture, phase, tiles, 0, tiles.tiles());
+		findBand(phase, tiles);
+		marchTiles(texture, tiles, 0, tiles.tiles());
+		gatherLines(tiles, lineA, lineB, nLine);
+	}
+
+	struct BenchPoly6
+	{
+		typedef float Value;
+		static Value eval(SPH &s, const Point2f &r) { return s.WPoly6(r); }
+	};
+
+	struct BenchSpikyGrad
+	{
+		typedef Point2f Value;
+		static Value eval(SPH &s, const Point2f &r) { return s.WSpikyGrad(r); }
+	};
+
+	struct BenchViscosityLap
+	{
+		typedef float Value;
+		static Value eval(SPH &s, const Point2f &r) { return s.WViscosityLap(r); }
+	};
+
+	struct BenchLucy
+	{
+		typedef float Value;
+		static Value eval(SPH &s, const Point2f &r) { return s.WLucy(r); }
+	};
+
+	static float benchSum(float v) { return v; }
+	static float benchSum(const Point2f &v) { return v.x + v.y; }
+	static float benchMag(float v) { return fabs(v); }
+	static float benchMag(const Point2f &v) { return v.Length(); }
+
+	// nanoseconds per evaluation; the values are summed into sum, which the
+	// caller checks so the loop cannot be optimized away
+	template <class K>
+	double benchTime(const Point2f *r, int n, int reps, float &sum)
+	{
+		int i, k;
+		clock_t t0 = clock();
+
+		sum = 0.0f;
+		for (k = 0; k < reps; k++)
+			for (i = 0; i < n; i++)
+				sum += benchSum(K::eval(*this, r[i]));
+		return 1e9 * (double)(clock() - t0) / CLOCKS_PER_SEC / ((double)n * reps);
+	}
+
+	template <class K>
+	void benchKernel(FILE *out, const char *name, const Point2f *r, int n, int reps)
+	{
+		int i;
+		double nsAnalytic, nsTable;
+		float err = 0.0f, peak = 0.0f, sumAnalytic, sumTable;
+		bool table = tabulated;
+		typename K::Value a, b;
+
+		tabulated = false;
+		nsAnalytic = benchTime<K>(r, n, reps, sumAnalytic);
+		tabulated = true;
+		nsTable = benchTime<K>(r, n, reps, sumTable);
+		for (i = 0; i < n; i++) {
+			tabulated = false;
+			a = K::eval(*this, r[i]);
+			tabulated = true;
+			b = K::eval(*this, r[i]);
+			if (benchMag(a) > peak) peak = benchMag(a);
+			if (benchMag(a - b) > err) err = benchMag(a - b);
+		}
+		tabulated = table;
+		fprintf(out, "%-14s %12.2f %12.2f %14.4e %14.4e\n", name, nsAnalytic, nsTable, err, err / peak);
+		if (sumAnalytic != sumAnalytic || sumTable != sumTable) fprintf(out, "%-14s NaN in the sums\n", name);
+	}
+
+	// adds the time since t to a stage and returns the time now, when timing
+	double lap(int stage, double t)
+	{
+		double now;
+
+		if (!timing) return 0.0;
+		now = wallClock();
+		stageSeconds[stage] += now - t;
+		return now;
+	}
+
+	// adds the stage times of the graph just run
+	void collectTimes(void)
+	{
+		int i;
+
+		if (!timing) return;
+		for (i = 0; i < (int)graph.nodes.size(); i++)
+			if (graph.nodes[i].tag >= 0) stageSeconds[graph.nodes[i].tag] += 1e-6 * graph.nodes[i].micros;
+	}
+
+	// stages of a scheduled step; ctx is the SPH, [begin, end) the particles,
+	// table cells or texture columns of one chunk
+	static void tableTask(void *s, int, int) { ((SPH *)s)->buildTable(); }
+	static void densityTask(void *s, int begin, int end) { ((SPH *)s)->computeDP(begin, end); }
+	static void forceTask(void *s, int begin, int end) { ((SPH *)s)->computeForce(begin, end); }
+	static void advanceTask(void *s, int begin, int end)
+	{
+		((SPH *)s)->advance(begin, end, ((SPH *)s)->partial[begin / TASK_GRAIN]);
+	}
+	static void statsTask(void *s, int, int) { ((SPH *)s)->sumStats((int)((SPH *)s)->partial.size()); }
+	static void splatTask(void *s, int begin, int end) { ((SPH *)s)->splatHeat(begin, end, begin / TASK_GRAIN); }
+	static void reduceHeatTask(void *s, int, int) { ((SPH *)s)->reduceHeat(); }
+	static void gatherGridTask(void *s, int begin, int end) { ((SPH *)s)->gatherGrid(begin, end); }
+	static void gridTask(void *s, int, int)
+	{
+		((SPH *)s)->computeDT();
+		((SPH *)s)->stepGrid();
+	}
+	static void heatTask(void *s, int begin, int end) { ((SPH *)s)->heatParticles(begin, end); }
+	static void pickAirTask(void *s, int begin, int end) { ((SPH *)s)->pickAirTargets(begin, end); }
+	static void moveAirTask(void *s, int, int)
+	{
+		((SPH *)s)->moveAir();
+		((SPH *)s)->updateBubbles();
+	}
+	static void waterScanTask(void *s, int, int)
+	{
+		SPH *o = (SPH *)s;
+		o->waterTiles.scan(o->p, o->pNum + o->gNum, water, o->kr);
+	}
+	static void iceScanTask(void *s, int, int)
+	{
+		SPH *o = (SPH *)s;
+		o->iceTiles.scan(o->p, o->pNum + o->gNum, ice, o->kr);
+	}
+	static void waterTask(void *s, int begin, int end)
+	{
+		SPH *o = (SPH *)s;
+		o->generateTexture(o->textureWater, water, o->waterTiles, begin, end);
+	}
+	static void iceTask(void *s, int begin, int end)
+	{
+		SPH *o = (SPH *)s;
+		o->generateTexture(o->textureIce, ice, o->iceTiles, begin, end);
+	}
+	static void waterBandTask(void *s, int, int) { ((SPH *)s)->findBand(water, ((SPH *)s)->waterTiles); }
+	static void iceBandTask(void *s, int, int) { ((SPH *)s)->findBand(ice, ((SPH *)s)->iceTiles); }
+	static void waterCellsTask(void *s, int begin, int end)
+	{
+		SPH *o = (SPH *)s;
+		o->marchTiles(o->textureWater, o->waterTiles, begin, end);
+	}
+	static void iceCellsTask(void *s, int begin, int end)
+	{
+		SPH *o = (SPH *)s;
+		o->marchTiles(o->textureIce, o->iceTiles, begin, end);
+	}
+	static void waterLinesTask(void *s, int, int)
+	{
+		SPH *o = (SPH *)s;
+		o->gatherLines(o->waterTiles, o->line0, o->line1, o->nLine0);
+	}
+	static void iceLinesTask(void *s, int, int)
+	{
+		SPH *o = (SPH *)s;
+		o->gatherLines(o->iceTiles, o->line2, o->line3, o->nLine1);
+	}
+
+	// scan, then dirty texels beside the band, dirty cells and the contour,
+	// for one field
+	void scheduleField(int heat, TaskGraph::RangeFn scan, TaskGraph::RangeFn texels, TaskGraph::RangeFn band,
+		TaskGraph::RangeFn cells, TaskGraph::RangeFn lines, int tiles)
+	{
+		int a, b, c, d, e;
+
+		a = graph.add(scan, this, 1, 1, STAGE_FIELDS);
+		graph.after(a, heat);
+		b = graph.add(texels, this, tiles, 1, STAGE_FIELDS);
+		graph.after(b, a);
+		c = graph.add(band, this, 1, 1, STAGE_FIELDS);
+		graph.after(c, a);
+		d = graph.add(cells, this, tiles, 1, STAGE_FIELDS);
+		graph.after(d, b);
+		graph.after(d, c);
+		e = graph.add(lines, this, 1, 1, STAGE_FIELDS);
+		graph.after(e, d);
+	}
+
+	// updateMotion as a graph. Once the heat has moved, the air, the water
+	// field and the ice field touch disjoint state and run side by side;
+	// every stage reads and writes what it does in the serial order, so the
+	// results do not change
+	void scheduleMotion(void)
+	{
+		int force, adv, sum, splat, cells, grid, heat, pick, air;
+
+		partial.resize((pNum + TASK_GRAIN - 1) / TASK_GRAIN);
+		graph.clear();
+		graph.timed = timing;
+		force = graph.add(forceTask, this, fluid.tSize, CELL_GRAIN, STAGE_FORCE);
+		adv = graph.add(advanceTask, this, pNum, TASK_GRAIN, STAGE_ADVANCE);
+		graph.after(adv, force);
+		sum = graph.add(statsTask, this, 1, 1, STAGE_ADVANCE);
+		graph.after(sum, adv);
+		//heat moves in the sweep with conduction, on the grid after it without
+		heat = adv;
+		if (freeze && !conducting()) {
+			heatChunks();
+			splat = graph.add(splatTask, this, pNum, TASK_GRAIN, STAGE_HEAT);
+			graph.after(splat, adv);
+			//the other processes' sums join in before the grid is gathered
+			if (gridReducer != NULL) {
+				grid = graph.add(reduceHeatTask, this, 1, 1, STAGE_HEAT);
+				graph.after(grid, splat);
+				splat = grid;
+			}
+			cells = graph.add(gatherGridTask, this, GRID_RES * GRID_RES, GRID_RES, STAGE_HEAT);
+			graph.after(cells, splat);
+			grid = graph.add(gridTask, this, 1, 1, STAGE_HEAT);
+			graph.after(grid, cells);
+			heat = graph.add(heatTask, this, pNum, TASK_GRAIN, STAGE_HEAT);
+			graph.after(heat, grid);
+		}
+		if (freeze) {
+			pick = graph.add(pickAirTask, this, pNum, TASK_GRAIN, STAGE_AIR);
+			graph.after(pick, heat);
+			air = graph.add(moveAirTask, this, 1, 1, STAGE_AIR);
+			graph.after(air, pick);
+			scheduleField(heat, waterScanTask, waterTask, waterBandTask, waterCellsTask, waterLinesTask, waterTiles.tiles());
+			scheduleField(heat, iceScanTask, iceTask, iceBandTask, iceCellsTask, iceLinesTask, iceTiles.tiles());
+		}
+		tasks->run(graph);
+		collectTimes();
+		if (freeze) textureVersion++;
 	}
 
 public:
-	int pNum;
+	SimParams param;
+	//owned particles, then ghosts copied from other processes at p[pNum..]
+	int pNum, gNum;
 	Particle *p;
 	float h;
+	//intensity fields, RENDER_SAMPLE x RENDER_SAMPLE
 	float *textureWater, *textureIce;
+	//bumped whenever the fields are regenerated
+	int textureVersion;
+	//tiles of each field that changed, and their contour segments
+	FieldTiles waterTiles, iceTiles;
 	int nLine0, nLine1;
 	Point2f *line0, *line1;
 	Point2f *line2, *line3;
 	int renderMode;
+	bool freeze;
+	Container boundary;
+	BoundaryParticles walls;
+	//kernels read from tables instead of evaluated
+	bool tabulated;
+	BubbleSystem bubbles;
+	//sources of new particles, the first from the parameters
+	std::vector<Emitter> emitters;
+	//container walls turn touching particles to air
+	bool airContact;
+
+	SweepStats stats;
+	//runs the stages of a step as a task graph when set, otherwise in order
+	TaskScheduler *tasks;
+	//steps between sorts of the particles by cell, 0 for never
+	int sortEvery;
+	//phase changes go here when set
+	EventLog *events;
+	//steps taken since init
+	int stepCount;
+	//time the stages of each step, for measure
+	bool timing;
+	//sums the heat grid over the processes of a distributed run when set
+	GridReducer *gridReducer;
+	//air brought in by the emitters, and carried out by removed particles,
+	//since init
+	double airInjected, airRemoved;
 
 	SPH()
 	{
-		h = TIME_STEP;
-		pNum = 0;
+		h = param.timeStep;
+		kr = kr2 = kr3 = kr4 = 0.0f;
+		pNum = gNum = 0;
 		p = NULL;
-		tLen = tSize = 0;
-		table = NULL;
-		textureWater = new float[RENDER_SAMPLE * RENDER_SAMPLE * 4];
-		textureIce = new float[RENDER_SAMPLE * RENDER_SAMPLE * 4];
+		spare = NULL;
+		nextId = 0;
+		sinceSort = 0;
+		sortEvery = SORT_EVERY;
+		dead = NULL;
+		airTarget = NULL;
+		wallGrad = NULL;
+		tasks = NULL;
+		events = NULL;
+		stepCount = 0;
+		timing = false;
+		gridReducer = NULL;
+		airInjected = airRemoved = 0.0;
+		timedSteps = 0;
+		memset(stageSeconds, 0, sizeof(stageSeconds));
+		textureWater = new float[RENDER_SAMPLE * RENDER_SAMPLE];
+		textureIce = new float[RENDER_SAMPLE * RENDER_SAMPLE];
+		memset(textureWater, 0, RENDER_SAMPLE * RENDER_SAMPLE * sizeof(float));
+		memset(textureIce, 0, RENDER_SAMPLE * RENDER_SAMPLE * sizeof(float));
+		textureVersion = 0;
 		nLine0 = 0;
 		nLine1 = 0;
 		line0 = new Point2f[RENDER_SAMPLE * RENDER_SAMPLE * 2];
@@ -653,12 +1172,23 @@ public:
 		line2 = new Point2f[RENDER_SAMPLE * RENDER_SAMPLE * 2];
 		line3 = new Point2f[RENDER_SAMPLE * RENDER_SAMPLE * 2];
 		renderMode = 0;
+		tabulated = false;
+		freeze = false;
+		airContact = false;
+		stats.totalAir = 0.0f;
+		stats.iceFraction = 0.0f;
+		stats.maxSpeed = 0.0f;
+		stats.kinetic = 0.0f;
+		stats.densityError = 0.0f;
 	}
 
 	~SPH()
 	{
 		if (p != NULL) delete []p;
-		if (table != NULL) delete []table;
+		if (spare != NULL) delete []spare;
+		if (airTarget != NULL) delete []airTarget;
+		if (wallGrad != NULL) delete []wallGrad;
+		if (dead != NULL) delete []dead;
 		if (textureWater != NULL) delete []textureWater;
 		if (textureIce != NULL) delete []textureIce;
 		if (line0 != NULL) delete []line0;
@@ -669,23 +1199,52 @@ public:
 
 	void init(int n)
 	{
-		pNum = 0;
-		p = new Particle[PARTICLE_NUM];
-
-		tLen = (int)(1.0f / KR) + 1;
-		tSize = SQ(tLen);
-		table = new Ptr[tSize];
-
-		pos0.Set(0.2f, 0.8f);
-		vel0.Set(0.8f, 0.6f);
-
-		normalizeKernels();
+		h = param.timeStep;
+		kr = param.kr;
+		kr2 = SQ(kr);
+		kr3 = kr2 * kr;
+		kr4 = SQ(kr2);
+
+		pNum = gNum = 0;
+		p = new Particle[param.maxParticles + param.maxGhosts];
+		idToIndex.clear();
+		stepCount = 0;
+		freeIds.clear();
+		nextId = 0;
+		sinceSort = 0;
+		airInjected = airRemoved = 0.0;
+		bubbles.released = 0.0;
+
+		fluid.init(kr, param.maxParticles + param.maxGhosts);
+		spare = new Particle[param.maxParticles];
+		airTarget = new int[param.maxParticles];
+		wallGrad = new Point2f[param.maxParticles];
+		dead = new unsigned char[param.maxParticles];
+		memset(dead, 0, param.maxParticles);
+
+		Emitter e;
+		e.shape = param.emitShape;
+		e.rate = param.emitRate;
+		e.batch = param.emitBatch;
+		e.size = param.emitSize;
+		e.pos.Set(param.emitX, param.emitY);
+		e.vel.Set(param.emitVX, param.emitVY);
+		emitters.assign(1, e);
+
+		boundary.bake(BOUNDARY_RES);
+		//wall particles sit at the rest spacing so they weigh like fluid
+		walls.sample(boundary, sqrt(param.mass / param.restDensity), kr);
+		walls.bake(BOUNDARY_FIELD_RES, Poly6Fn(this), SpikyGradFn(this), ViscosityLapFn(this));
 		//
-		for(int i = 0; i < 50; i++)
-			for(int j = 0; j < 50; j++)
+		for(int i = 0; i < GRID_RES; i++)
+			for(int j = 0; j < GRID_RES; j++)
 			{
 				Grid[i][j].pos.x = i * gridSize + gridSize / 2.0;
 				Grid[i][j].pos.y = j * gridSize + gridSize / 2.0;
+				Grid[i][j].T = param.Twater;
+				Grid[i][j].DT = 0.0f;
+				Grid[i][j].w = Grid[i][j].wIce = 0.0f;
+				Grid[i][j].flagOfData = false;
 			}
 	}
 
@@ -697,10 +1256,9 @@ public:
 		float DT;
 		int t = 0;
 		float alpha , x, y;
-		int Pice;
-		for(int i = 0; i < 50; i++)
+		for(int i = 0; i < GRID_RES; i++)
 		{
-			for(int j = 0; j < 50; j++)
+			for(int j = 0; j < GRID_RES; j++)
 			{
 				if(!Grid[i][j].flagOfData)
 				{
@@ -713,24 +1271,20 @@ public:
 		}
 		
 		//DT for every grid
-		for(int i = 0; i < 50; i++)
+		for(int i = 0; i < GRID_RES; i++)
 		{
-			for(int j = 0; j < 50; j++)
+			for(int j = 0; j < GRID_RES; j++)
 			{
 				if(Grid[i][j].flagOfData)
 				{
 					//L1 = Grid[i][j].pos.x;
 					//L4 = 1 - Grid[i][j].pos.y;
 					//alpha
-					Pice = 0;
-					for (std::vector<Particle *>::iterator it = Grid[i][j].pv.begin() ; it != Grid[i][j].pv.end(); ++it)
-						if((*it)->phase == ice)
-							Pice++;
-					float W = Pice / Grid[i][j].pv.size();
-					alpha = (1 - W) * cThermalWater + W * cThermalIce;
+					float W = Grid[i][j].wIce / Grid[i][j].w;
+					alpha = (1 - W) * param.cThermalWater + W * param.cThermalIce;
 					x = Grid[i][j].pos.x;
 					y = Grid[i][j].pos.y;
-					DT = (-1) * alpha * (Tfreeze - Tair) * ( 1/pow(x,2) + 1/pow(1-x, 2) + 1/pow(y, 2) + 1/pow(up - y, 2));
+					DT = (-1) * alpha * (param.Tfreeze - param.Tair) * ( 1/pow(x,2) + 1/pow(1-x, 2) + 1/pow(y, 2) + 1/pow(up - y, 2));
 					Grid[i][j].DT = DT/ 10000.0f;
 					//printf("Pice: %d\n",Pice); 
 					//printf("alpha: %f\n", alpha);
@@ -741,61 +1295,413 @@ public:
 
 	}
 
+	// one step of every emitter; a batch that does not fit is dropped
 	void generateParticle(void)
 	{
-		int i, n = 4;
-		float r = 0.015625f;
+		int i, j, k, n;
+
+		for (k = 0; k < (int)emitters.size(); k++) {
+			Emitter &e = emitters[k];
+			for (n = e.batches(); n > 0; n--) {
+				if (pNum + e.batch > param.maxParticles) continue;
+				for (i = 0; i < e.batch; i++) {
+					p[pNum].pos = e.place(i);
+					p[pNum].vel = e.vel;
+					p[pNum].acc.Zero();
+					if (freeIds.empty()) p[pNum].id = nextId++;
+					else {
+						p[pNum].id = freeIds.back();
+						freeIds.pop_back();
+					}
+					//
+					p[pNum].phase = water;
+					p[pNum].T = param.Twater;
+					p[pNum].dT = 0.0f;
+					p[pNum].S = 0.15f;
+					airInjected += p[pNum].S;
+					j = p[pNum].id;
+					if (j >= (int)idToIndex.size()) idToIndex.resize(j + 1, -1);
+					idToIndex[j] = pNum;
+					pNum++;
+				}
+			}
+		}
+	}
+
+	// marks an owned particle for removal before the next step
+	void kill(int i)
+	{
+		dead[i] = 1;
+	}
+
+	// drops the dead particles, keeping the rest dense and in order, so a
+	// cell sorted layout stays sorted. Survivors per chunk are counted in
+	// parallel, a prefix sum over the chunks gives where each chunk's go,
+	// and the chunks from the first one that lost a particle move theirs at
+	// once; only the IDs of particles that moved are looked up again.
+	// Between steps, like sortParticles.
+	void removeKilled(void)
+	{
+		int c, i, k, e, first, chunks = (pNum + TASK_GRAIN - 1) / TASK_GRAIN;
+
+		kept.resize(chunks + 1);
+		kept[0] = 0;
+#pragma omp parallel for private(i, e, k) schedule(static)
+		for (c = 0; c < chunks; c++) {
+			e = (c + 1) * TASK_GRAIN < pNum ? (c + 1) * TASK_GRAIN : pNum;
+			k = 0;
+			for (i = c * TASK_GRAIN; i < e; i++) k += !dead[i];
+			kept[c + 1] = k;
+		}
+		for (c = 0, first = -1; c < chunks; c++) {
+			e = (c + 1) * TASK_GRAIN < pNum ? TASK_GRAIN : pNum - c * TASK_GRAIN;
+			if (first < 0 && kept[c + 1] < e) first = c;
+			kept[c + 1] += kept[c];
+		}
+		if (first < 0) return;
+
+		for (i = first * TASK_GRAIN; i < pNum; i++) {
+			if (!dead[i]) continue;
+			airRemoved += p[i].S;
+			freeIds.push_back(p[i].id);
+			idToIndex[p[i].id] = -1;
+		}
+#pragma omp parallel for private(i, e, k) schedule(static)
+		for (c = first; c < chunks; c++) {
+			e = (c + 1) * TASK_GRAIN < pNum ? (c + 1) * TASK_GRAIN : pNum;
+			k = kept[c];
+			for (i = c * TASK_GRAIN; i < e; i++) {
+				if (dead[i]) continue;
+				spare[k] = p[i];
+				idToIndex[p[i].id] = k;
+				k++;
+			}
+		}
+		std::copy(spare + kept[first], spare + kept[chunks], p + kept[first]);
+		memset(dead + first * TASK_GRAIN, 0, pNum - first * TASK_GRAIN);
+		pNum = kept[chunks];
+	}
+
+	// index of the owned particle with this ID, -1 when there is none here
+	int indexOf(unsigned int id)
+	{
+		return id < idToIndex.size() ? idToIndex[id] : -1;
+	}
+
+	// every sortEvery steps the owned particles are laid out cell by cell,
+	// so neighbours are close in memory. Only between steps: ghosts sent to
+	// other processes are known by index until the step ends.
+	void sortParticles(void)
+	{
+		int i;
+
+		if (sortEvery <= 0 || ++sinceSort < sortEvery) return;
+		sinceSort = 0;
+		fluid.countCells(p, pNum);
+		for (i = 0; i < pNum; i++) spare[i] = p[fluid.cellIndex[i]];
+		std::copy(spare, spare + pNum, p);
+		reindex();
+	}
+
+	// where the first emitter is, outside the domain when there is none
+	Point2f source(void)
+	{
+		return emitters.empty() ? Point2f(-1.0f, -1.0f) : emitters[0].pos;
+	}
+
+	float gridTemperature(int i, int j)
+	{
+		return Grid[i][j].T;
+	}
 
+	// ns per pair and worst deviation of the tables from the analytic kernels,
+	// over pairs spread uniformly in the kernel support
+	void benchmarkKernels(FILE *out)
+	{
+		int i, n = 1 << 16, reps = 64;
+		Point2f *r = new Point2f[n];
+
+		srand(1);
 		for (i = 0; i < n; i++) {
-			p[pNum].pos = pos0 + r * Point2f(cos((float)i / n * D360), sin((float)i / n * D360));
-			p[pNum].vel = vel0;
-			p[pNum].acc.Zero();
-			p[pNum].next = NULL;
-			//
-			p[pNum].phase = water;
-			p[pNum].T = Twater;
-			p[pNum].S = 0.15f;
-			p[pNum].volume = 0.0f;
-			pNum++;
+			do {
+				r[i].Set(kr * (2.0f * rand() / RAND_MAX - 1.0f), kr * (2.0f * rand() / RAND_MAX - 1.0f));
+			} while (r[i].LengthSquared() > kr2);
 		}
+
+		fprintf(out, "kernel table: %d entries over r^2 in [0, KR^2]\n", KERNEL_TABLE_SIZE);
+		fprintf(out, "%-14s %12s %12s %14s %14s\n", "kernel", "analytic ns", "table ns", "max abs err", "err / peak");
+		benchKernel<BenchPoly6>(out, "WPoly6", r, n, reps);
+		benchKernel<BenchSpikyGrad>(out, "WSpikyGrad", r, n, reps);
+		benchKernel<BenchViscosityLap>(out, "WViscosityLap", r, n, reps);
+		benchKernel<BenchLucy>(out, "WLucy", r, n, reps);
+
+		delete []r;
 	}
 
-	void update(void)
+	// a step in two halves, so a distributed run can refresh the density and
+	// pressure of its ghosts in between
+	void updateDensity(void)
 	{
-		buildTable();
-		computeDP();
-		computeForce();
-		integrate();
-		fixBoundary();
+		int table, dens;
+		double t = timing ? wallClock() : 0.0;
+
+		if (tasks == NULL) {
+			buildTable();
+			computeDP(0, fluid.tSize);
+			lap(STAGE_DENSITY, t);
+			return;
+		}
+		graph.clear();
+		graph.timed = timing;
+		table = graph.add(tableTask, this, 1, 1, STAGE_DENSITY);
+		dens = graph.add(densityTask, this, fluid.tSize, CELL_GRAIN, STAGE_DENSITY);
+		graph.after(dens, table);
+		tasks->run(graph);
+		collectTimes();
+	}
 
-		//generateTexture(textureWater, water, colorWater);
-		//marchingSquares(textureWater, line0, line1, nLine0);
+	void updateMotion(void)
+	{
+		double t = timing ? wallClock() : 0.0;
 
-		float sumS = 0.0f;
-		for (int i = 0; i < pNum; i++) {
-			sumS += p[i].S;
+		if (timing) timedSteps++;
+		if (tasks != NULL) {
+			scheduleMotion();
+			stepCount++;
+			return;
 		}
-		
+		computeForce(0, fluid.tSize);
+		t = lap(STAGE_FORCE, t);
+		advance();
+		t = lap(STAGE_ADVANCE, t);
+
+		//generateTexture(textureWater, water);
+		//marchingSquares(textureWater, line0, line1, nLine0);
+
 		if(freeze)
 		{
-			if(!gridBuilt)
-			{
+			//conduction already moved the heat in the sweep
+			if (!conducting()) {
 				buildGrid();
-				gridBuilt = true;
+				computeDT();
+				transferHeat();
+				t = lap(STAGE_HEAT, t);
 			}
-			//checkAir();
-			computeDT();
-			transferHeat();
 			updateDissolvedAir();
-			fixIce();
+			updateBubbles();
+			t = lap(STAGE_AIR, t);
 
-			generateTexture(textureWater, water, colorWater);
-			marchingSquares(textureWater, line0, line1, nLine0);
+			redrawField(textureWater, water, waterTiles, line0, line1, nLine0);
+			redrawField(textureIce, ice, iceTiles, line2, line3, nLine1);
+			textureVersion++;
+			lap(STAGE_FIELDS, t);
+		}
+		stepCount++;
+	}
+
+	void update(void)
+	{
+		double t = timing ? wallClock() : 0.0;
+
+		removeKilled();
+		sortParticles();
+		lap(STAGE_LAYOUT, t);
+		updateDensity();
+		updateMotion();
+	}
 
-			generateTexture(textureIce, ice, colorIce);
-			marchingSquares(textureIce, line2, line3, nLine1);
+	// health of the run after the last step, with the stage times since the
+	// last call, which start again from zero
+	void measure(StepMetrics &m)
+	{
+		int i;
+
+		m.step = stepCount;
+		m.particles = pNum;
+		m.bubbles = bubbles.count();
+		m.mass = stats.mass;
+		m.kinetic = stats.kinetic;
+		m.densityError = stats.densityError;
+		m.iceFraction = stats.iceFraction;
+		m.dissolvedAir = stats.totalAir;
+		m.bubbleAir = 0.0f;
+		for (i = 0; i < bubbles.count(); i++) m.bubbleAir += bubbles.b[i].volume;
+		m.airInjected = (float)airInjected;
+		m.airReleased = (float)(bubbles.released + airRemoved);
+		m.airDrift = m.dissolvedAir + m.bubbleAir - (m.airInjected - m.airReleased);
+		m.maxSpeed = stats.maxSpeed;
+		m.steps = timedSteps;
+		for (i = 0; i < STAGES; i++) {
+			m.stage[i] = stageSeconds[i];
+			stageSeconds[i] = 0.0;
+		}
+		timedSteps = 0;
+	}
+
+	// spatial queries over the cell table, ghosts included, each predicate
+	// deciding per particle. The table is the one built at the start of the
+	// last step, so particles may have moved up to a step since.
+
+	// indices of the particles within r of c accepted by pred, appended to
+	// out in cell order; returns how many
+	template <class Pred>
+	int inRadius(const Point2f &c, float r, Pred pred, std::vector<int> &out)
+	{
+		int n, y, x0, x1, y1, end, found = 0;
+		float r2 = SQ(r);
+
+		x0 = clampCell(c.x - r);
+		x1 = clampCell(c.x + r);
+		y1 = clampCell(c.y + r);
+		for (y = clampCell(c.y - r); y <= y1; y++) {
+			end = fluid.cellStart[x1 + 1 + y * fluid.tLen];
+			for (n = fluid.cellStart[x0 + y * fluid.tLen]; n < end; n++) {
+				Particle *q = &p[fluid.cellIndex[n]];
+				if ((q->pos - c).LengthSquared() <= r2 && pred(q)) {
+					out.push_back(fluid.cellIndex[n]);
+					found++;
+				}
+			}
+		}
+		return found;
+	}
+
+	// indices of the particles inside the box from lo to hi accepted by
+	// pred, appended to out in cell order; returns how many
+	template <class Pred>
+	int inBox(const Point2f &lo, const Point2f &hi, Pred pred, std::vector<int> &out)
+	{
+		int n, y, x0, x1, y1, end, found = 0;
+
+		x0 = clampCell(lo.x);
+		x1 = clampCell(hi.x);
+		y1 = clampCell(hi.y);
+		for (y = clampCell(lo.y); y <= y1; y++) {
+			end = fluid.cellStart[x1 + 1 + y * fluid.tLen];
+			for (n = fluid.cellStart[x0 + y * fluid.tLen]; n < end; n++) {
+				Particle *q = &p[fluid.cellIndex[n]];
+				if (q->pos.x >= lo.x && q->pos.x <= hi.x && q->pos.y >= lo.y && q->pos.y <= hi.y && pred(q)) {
+					out.push_back(fluid.cellIndex[n]);
+					found++;
+				}
+			}
+		}
+		return found;
+	}
+
+	// the k particles nearest pos accepted by pred, nearest first, into out
+	// with their squared distances in d2; returns how many were found. The
+	// search grows by a ring of cells at a time, up to rings rings, skipping
+	// cells farther than the kth best and stopping once all the rest are
+	template <class Pred>
+	int nearest(const Point2f &pos, int k, Pred pred, int *out, float *d2, int rings = INT_MAX)
+	{
+		int j, n, x, y, x0, y0, ring, step, found = 0;
+		float ex, ey, d, reach;
+
+		if (k < 1) return 0;
+		x0 = clampCell(pos.x);
+		y0 = clampCell(pos.y);
+		for (ring = 0; ring <= rings; ring++) {
+			for (y = y0 - ring; y <= y0 + ring; y++) {
+				if (y < 0 || y > fluid.tLen - 1) continue;
+				//whole first and last rows, the two ends of the others
+				step = y == y0 - ring || y == y0 + ring ? 1 : 2 * ring;
+				for (x = x0 - ring; x <= x0 + ring; x += step) {
+					if (x < 0 || x > fluid.tLen - 1) continue;
+					ex = x < x0 ? pos.x - (x + 1) * kr : (x > x0 ? x * kr - pos.x : 0.0f);
+					ey = y < y0 ? pos.y - (y + 1) * kr : (y > y0 ? y * kr - pos.y : 0.0f);
+					if (found == k && SQ(ex) + SQ(ey) >= d2[k - 1]) continue;
+					for (n = fluid.cellStart[x + y * fluid.tLen]; n < fluid.cellStart[x + 1 + y * fluid.tLen]; n++) {
+						Particle *q = &p[fluid.cellIndex[n]];
+						if (!pred(q)) continue;
+						d = (pos - q->pos).LengthSquared();
+						if (found == k && d >= d2[k - 1]) continue;
+						//insertion after any equal ones, so the first seen wins ties
+						if (found < k) found++;
+						for (j = found - 1; j > 0 && d2[j - 1] > d; j--) {
+							d2[j] = d2[j - 1];
+							out[j] = out[j - 1];
+						}
+						d2[j] = d;
+						out[j] = fluid.cellIndex[n];
+					}
+				}
+			}
+			if (x0 - ring <= 0 && y0 - ring <= 0 && x0 + ring >= fluid.tLen - 1 && y0 + ring >= fluid.tLen - 1) break;
+			//nothing unseen is nearer than the edge of the rings searched
+			reach = (std::min)((std::min)(pos.x - (x0 - ring) * kr, (x0 + ring + 1) * kr - pos.x),
+				(std::min)(pos.y - (y0 - ring) * kr, (y0 + ring + 1) * kr - pos.y));
+			if (found == k && reach > 0.0f && SQ(reach) >= d2[k - 1]) break;
+		}
+		return found;
+	}
+
+	// fields interpolated at pos
+	FieldSample sample(const Point2f &pos)
+	{
+		int q = 0;
+		FieldSample s;
+
+		sampleCell(clampCell(pos.x) + clampCell(pos.y) * fluid.tLen, &q, 1, &pos, &s);
+		return s;
+	}
+
+	// fields interpolated at n points into out. The points are sorted by
+	// cell and each cell's neighbours are walked once for all its points,
+	// cells in parallel; every point gets what sample would give it
+	void sample(const Point2f *pos, int n, FieldSample *out)
+	{
+		int c;
+
+		binQueries(pos, n);
+#pragma omp parallel for schedule(dynamic, 4)
+		for (c = 0; c < fluid.tSize; c++)
+			if (queryStart[c + 1] > queryStart[c])
+				sampleCell(c, &queryIndex[queryStart[c]], queryStart[c + 1] - queryStart[c], pos, out);
+	}
+
+	// nearest for n points, k slots each of out and d2 per point and the
+	// number found in found; points run in cell order, in parallel
+	template <class Pred>
+	void nearest(const Point2f *pos, int n, int k, Pred pred, int *out, float *d2, int *found)
+	{
+		int a, q;
+
+		binQueries(pos, n);
+#pragma omp parallel for private(q) schedule(dynamic, 64)
+		for (a = 0; a < n; a++) {
+			q = queryIndex[a];
+			found[q] = nearest(pos[q], k, pred, out + q * k, d2 + q * k);
 		}
 	}
+
+	// textures and contours of the current particles, for frames that were
+	// loaded rather than simulated
+	void regenerate(void)
+	{
+		buildTable();
+		redrawField(textureWater, water, waterTiles, line0, line1, nLine0);
+		redrawField(textureIce, ice, iceTiles, line2, line3, nLine1);
+		textureVersion++;
+	}
+
+	// trade textures and contours with another instance, without copying
+	void swapRender(SPH &o)
+	{
+		std::swap(textureWater, o.textureWater);
+		std::swap(textureIce, o.textureIce);
+		std::swap(line0, o.line0);
+		std::swap(line1, o.line1);
+		std::swap(line2, o.line2);
+		std::swap(line3, o.line3);
+		std::swap(nLine0, o.nLine0);
+		std::swap(nLine1, o.nLine1);
+		waterTiles.swap(o.waterTiles);
+		iceTiles.swap(o.iceTiles);
+		textureVersion++;
+		o.textureVersion++;
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+#ifndef _SPH_CORE_H_
+#define _SPH_CORE_H_
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "const.h"
+#include "KernelTable.h"
+
+// what the solver core holds particle data in, and what it sums neighbour
+// contributions in
+struct FloatPrecision
+{
+	typedef float Real;
+	typedef float Accum;
+};
+
+struct DoublePrecision
+{
+	typedef double Real;
+	typedef double Accum;
+};
+
+//float data, double sums
+struct MixedPrecision
+{
+	typedef float Real;
+	typedef double Accum;
+};
+
+// kernel normalizations in closed form, so each kernel integrates to 1
+// over the ball of radius h, and the rows of cells a cell's neighbours lie
+// in: 3 in 2D, 9 in 3D, each the cells beside a cell of the row
+template <int Dim> struct KernelNorm;
+
+template <> struct KernelNorm<2>
+{
+	enum { rows = 3 };
+	static double poly6(double h) { return 4.0 / (PI * pow(h, 8)); }
+	static double spiky(double h) { return 10.0 / (PI * pow(h, 5)); }
+	static double viscosity(double h) { return 10.0 / (3.0 * PI * h * h); }
+	static double lucy(double h) { return 5.0 / (PI * h * h); }
+};
+
+template <> struct KernelNorm<3>
+{
+	enum { rows = 9 };
+	static double poly6(double h) { return 315.0 / (64.0 * PI * pow(h, 9)); }
+	static double spiky(double h) { return 15.0 / (PI * pow(h, 6)); }
+	static double viscosity(double h) { return 15.0 / (2.0 * PI * h * h * h); }
+	static double lucy(double h) { return 105.0 / (16.0 * PI * h * h * h); }
+};
+
+// smoothing kernels and neighbour pair loops for a precision policy P in
+// Dim dimensions. Both are template arguments, so every instantiation is
+// one straight code path: the 2D solver uses one, and checkCores runs the
+// others against it.
+template <class P, int Dim>
+class SPHCore
+{
+public:
+	typedef typename P::Real Real;
+	typedef typename P::Accum Accum;
+	//rows of cells around a cell holding its neighbours
+	enum { rows = KernelNorm<Dim>::rows };
+
+	// particles copied side by side so the pair loops read them from L1
+	// and vectorize
+	struct Tile
+	{
+		int n;
+		int index[PAIR_TILE];
+		Real x[Dim][PAIR_TILE], v[Dim][PAIR_TILE];
+		Real dens[PAIR_TILE], pressure[PAIR_TILE], T[PAIR_TILE];
+	};
+
+	// neighbour sums of the particles of a home tile
+	struct Sums
+	{
+		Accum dens[PAIR_TILE];
+		Accum ap[Dim][PAIR_TILE], av[Dim][PAIR_TILE];
+		Accum heat[PAIR_TILE];
+	};
+
+	Real kr, kr2, kr3, kr4;
+	Real poly6Scale, spikyScale, viscosityScale, lucyScale;
+	KernelTable tPoly6, tPoly6Grad, tSpiky, tSpikyGrad;
+	KernelTable tViscosity, tViscosityLap, tLucy, tLucyGrad;
+
+	SPHCore()
+	{
+		kr = kr2 = kr3 = kr4 = 0;
+		poly6Scale = spikyScale = viscosityScale = lucyScale = 0;
+	}
+
+	void init(Real h)
+	{
+		kr = h;
+		kr2 = kr * kr;
+		kr3 = kr2 * kr;
+		kr4 = kr2 * kr2;
+		poly6Scale = (Real)KernelNorm<Dim>::poly6(h);
+		spikyScale = (Real)KernelNorm<Dim>::spiky(h);
+		viscosityScale = (Real)KernelNorm<Dim>::viscosity(h);
+		lucyScale = (Real)KernelNorm<Dim>::lucy(h);
+		buildTables();
+	}
+
+	//offset along axis 0 (y) or 1 (z) of neighbour row k
+	static int rowOffset(int k, int axis)
+	{
+		return (axis == 0 ? k : k / 3) % 3 - 1;
+	}
+
+	//radial parts of the kernels, r2 <= kr2
+	inline Real poly6(Real r2)
+	{
+		Real a = kr2 - r2;
+		return poly6Scale * CUBE(a);
+	}
+
+	inline Real poly6Grad(Real r2)
+	{
+		Real a = kr2 - r2;
+		return (Real)-6 * poly6Scale * SQ(a);
+	}
+
+	inline Real spiky(Real r2)
+	{
+		Real a = kr - sqrt(r2);
+		return spikyScale * CUBE(a);
+	}
+
+	inline Real spikyGrad(Real r2)
+	{
+		if (r2 < EPS) r2 = EPS;
+		Real r = sqrt(r2);
+		return (Real)-3 * spikyScale * (kr - r) * (kr - r) / r;
+	}
+
+	inline Real viscosity(Real r2)
+	{
+		if (r2 < EPS) r2 = EPS;
+		Real r = sqrt(r2);
+		Real r3 = r * r * r;
+		return viscosityScale * (((-r3 / ((Real)2 * kr3)) + (r2 / kr2) + kr / ((Real)2 * r)) - (Real)1);
+	}
+
+	inline Real viscosityLap(Real r2)
+	{
+		Real r = sqrt(r2);
+		return viscosityScale * ((Real)6 / kr3) * (kr - r);
+	}
+
+	inline Real lucy(Real r2)
+	{
+		Real r = sqrt(r2);
+		Real a = ((Real)1 + (Real)3 * r / kr) * CUBE(1 - r / kr);
+		return lucyScale * a;
+	}
+
+	inline Real lucyGrad(Real r2)
+	{
+		Real r = sqrt(r2);
+		return (Real)-12 * (kr2 - (Real)2 * r * kr + r2) / kr4;
+	}
+
+	struct Radial
+	{
+		SPHCore *s;
+		Real (SPHCore::*f)(Real);
+		Radial(SPHCore *core, Real (SPHCore::*fn)(Real)) : s(core), f(fn) {}
+		float operator()(float r2) const { return (float)(s->*f)((Real)r2); }
+	};
+
+	void buildTables(void)
+	{
+		float range = (float)kr2;
+
+		tPoly6.build(Radial(this, &SPHCore::poly6), range);
+		tPoly6Grad.build(Radial(this, &SPHCore::poly6Grad), range);
+		tSpiky.build(Radial(this, &SPHCore::spiky), range);
+		tSpikyGrad.build(Radial(this, &SPHCore::spikyGrad), range);
+		tViscosity.build(Radial(this, &SPHCore::viscosity), range);
+		tViscosityLap.build(Radial(this, &SPHCore::viscosityLap), range);
+		tLucy.build(Radial(this, &SPHCore::lucy), range);
+		tLucyGrad.build(Radial(this, &SPHCore::lucyGrad), range);
+	}
+
+	inline Real dist2(const Tile &home, int a, const Tile &near, int b, Real *dx)
+	{
+		int d;
+		Real r2;
+
+		dx[0] = home.x[0][a] - near.x[0][b];
+		r2 = dx[0] * dx[0];
+		for (d = 1; d < Dim; d++) {
+			dx[d] = home.x[d][a] - near.x[d][b];
+			r2 += dx[d] * dx[d];
+		}
+		return r2;
+	}
+
+	// the home tile's particles are the vector lanes and each neighbour is
+	// broadcast to them in turn, so every particle still sums its neighbours
+	// in table order. Pairs out of reach, and a particle with itself, add 0;
+	// the sums are restrict so the kernel constants stay in registers.
+	template <bool Table>
+	void densityPairs(const Tile &home, const Tile &near, Sums *__restrict s)
+	{
+		int a, b;
+		Real dx[Dim], r2, w;
+
+		for (b = 0; b < near.n; b++) {
+			for (a = 0; a < home.n; a++) {
+				r2 = dist2(home, a, near, b, dx);
+				w = Table ? (Real)tPoly6((float)r2) : poly6(r2);
+				w = r2 <= kr2 ? w : (Real)0;
+				s->dens[a] += home.index[a] != near.index[b] ? w : (Real)0;
+			}
+		}
+	}
+
+	template <bool Table>
+	void forcePairs(const Tile &home, const Tile &near, Sums *__restrict s)
+	{
+		int a, b, d;
+		Real dx[Dim], r2, f, g, lap;
+
+		for (b = 0; b < near.n; b++) {
+			for (a = 0; a < home.n; a++) {
+				r2 = dist2(home, a, near, b, dx);
+				g = Table ? (Real)tSpikyGrad((float)r2) : spikyGrad(r2);
+				lap = (Table ? (Real)tViscosityLap((float)r2) : viscosityLap(r2)) / near.dens[b];
+				g = r2 <= kr2 ? g : (Real)0;
+				lap = r2 <= kr2 ? lap : (Real)0;
+				g = home.index[a] != near.index[b] ? g : (Real)0;
+				lap = home.index[a] != near.index[b] ? lap : (Real)0;
+				f = (home.pressure[a] + near.pressure[b]) / near.dens[b];
+				for (d = 0; d < Dim; d++) {
+					s->ap[d][a] -= f * (dx[d] * g);
+					s->av[d][a] += (near.v[d][b] - home.v[d][a]) * lap;
+				}
+				s->heat[a] += lap * (near.T[b] - home.T[a]);
+			}
+		}
+	}
+
+	// integrals of the kernels over the ball of radius kr by midpoint sums
+	// on n cells per axis, each 1 when the normalization is right
+	void integrals(int n, double *total)
+	{
+		int k, d, m, cells = 1;
+		double r2, x, dV = 1.0;
+
+		for (d = 0; d < Dim; d++) {
+			cells *= n;
+			dV *= 2.0 * kr / n;
+		}
+		total[0] = total[1] = total[2] = total[3] = 0.0;
+		for (k = 0; k < cells; k++) {
+			r2 = 0.0;
+			for (d = 0, m = k; d < Dim; d++, m /= n) {
+				x = -kr + (m % n + 0.5) * 2.0 * kr / n;
+				r2 += x * x;
+			}
+			if (r2 > kr2) continue;
+			total[0] += poly6((Real)r2) * dV;
+			total[1] += spiky((Real)r2) * dV;
+			total[2] += viscosity((Real)r2) * dV;
+			total[3] += lucy((Real)r2) * dV;
+		}
+	}
+
+	// nanoseconds per pair of the density and force loops over two tiles of
+	// particles scattered in a box of side kr; returns a sum of what they
+	// summed, which is NaN if they went wrong
+	double pairTimes(int reps, double &nsDensity, double &nsForce)
+	{
+		int i, d, k;
+		Tile home, near;
+		Sums *s = new Sums;
+		clock_t t0;
+		double sum;
+
+		srand(1);
+		home.n = near.n = PAIR_TILE;
+		for (i = 0; i < PAIR_TILE; i++) {
+			home.index[i] = i;
+			near.index[i] = PAIR_TILE + i;
+			for (d = 0; d < Dim; d++) {
+				home.x[d][i] = kr * rand() / RAND_MAX;
+				near.x[d][i] = kr * rand() / RAND_MAX;
+				home.v[d][i] = near.v[d][i] = (Real)0;
+			}
+			home.dens[i] = near.dens[i] = (Real)1;
+			home.pressure[i] = near.pressure[i] = (Real)1;
+			home.T[i] = near.T[i] = (Real)0;
+			s->dens[i] = s->heat[i] = 0;
+			for (d = 0; d < Dim; d++) s->ap[d][i] = s->av[d][i] = 0;
+		}
+		t0 = clock();
+		for (k = 0; k < reps; k++) densityPairs<false>(home, near, s);
+		nsDensity = 1e9 * (double)(clock() - t0) / CLOCKS_PER_SEC / ((double)PAIR_TILE * PAIR_TILE * reps);
+		t0 = clock();
+		for (k = 0; k < reps; k++) forcePairs<false>(home, near, s);
+		nsForce = 1e9 * (double)(clock() - t0) / CLOCKS_PER_SEC / ((double)PAIR_TILE * PAIR_TILE * reps);
+		for (sum = 0.0, i = 0; i < PAIR_TILE; i++) sum += (double)(s->dens[i] + s->ap[0][i]);
+		delete s;
+		return sum;
+	}
+};
+
+template <class P, int Dim>
+void checkCore(FILE *out, const char *name, float kr)
+{
+	SPHCore<P, Dim> core;
+	double total[4], nsDensity, nsForce, sum;
+
+	core.init(kr);
+	core.integrals(Dim == 2 ? 1000 : 200, total);
+	sum = core.pairTimes(2000, nsDensity, nsForce);
+	if (sum != sum) fprintf(out, "%-10s NaN in the sums\n", name);
+	fprintf(out, "%-10s %10.2e %10.2e %10.2e %10.2e %10.2f %10.2f\n", name,
+		total[0] - 1.0, total[1] - 1.0, total[2] - 1.0, total[3] - 1.0, nsDensity, nsForce);
+}
+
+// the kernel normalizations and pair loop speed of each instantiation, for
+// validating the 2D solver's against double and 3D
+inline void checkCores(FILE *out, float kr)
+{
+	fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s\n", "core", "poly6", "spiky", "viscosity",
+		"lucy", "ns/dens", "ns/force");
+	checkCore<FloatPrecision, 2>(out, "float 2D", kr);
+	checkCore<MixedPrecision, 2>(out, "mixed 2D", kr);
+	checkCore<DoublePrecision, 2>(out, "double 2D", kr);
+	checkCore<FloatPrecision, 3>(out, "float 3D", kr);
+	checkCore<MixedPrecision, 3>(out, "mixed 3D", kr);
+	checkCore<DoublePrecision, 3>(out, "double 3D", kr);
+}
+
+#endif
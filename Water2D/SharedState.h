@@ -0,0 +1,353 @@
+#ifndef _SHARED_STATE_H_
+#define _SHARED_STATE_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#define SHARED_FENCE() MemoryBarrier()
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define SHARED_FENCE() __sync_synchronize()
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "const.h"
+#include "SPH.h"
+
+#define SHARED_MAGIC 0x57443253
+#define SHARED_VERSION 2
+
+// layout of the shared region: the header, then slots frames at slotBytes
+// apart, each a SharedFrame followed by its particle, grid and line arrays.
+// Everything is plain data at fixed offsets so any process can read it.
+struct SharedHeader
+{
+	unsigned int magic, version;
+	int slots, maxParticles, gridRes, maxSegments;
+	unsigned int slotBytes, particleOffset, gridOffset, lineOffset;
+	//number of the newest complete frame, -1 before the first
+	volatile int latest;
+};
+
+struct SharedParticle
+{
+	float x, y, vx, vy;
+	float dens, T, S;
+	int phase;
+	//stable particle ID, the same in every frame
+	unsigned int id;
+};
+
+struct SharedFrame
+{
+	//odd while the solver is writing the slot
+	volatile unsigned int seq;
+	int frame;
+	int pNum;
+	//segments of the water and of the ice contour
+	int nWater, nIce;
+	float iceFraction, totalAir, maxSpeed;
+};
+
+// the solver side: owns the region and publishes one frame per call into a
+// ring of slots. A slot is only rewritten slots - 1 frames after it was
+// last published, so readers on the newest frame seldom have to retry.
+class SharedStateWriter
+{
+private:
+	std::string name;
+	char *base;
+	unsigned int bytes;
+	int frame;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+
+	SharedHeader *header(void) { return (SharedHeader *)base; }
+
+public:
+	SharedStateWriter()
+	{
+		base = NULL;
+		bytes = 0;
+		frame = 0;
+#ifdef _WIN32
+		mapping = NULL;
+#endif
+	}
+
+	~SharedStateWriter()
+	{
+		close();
+	}
+
+	bool create(const char *regionName, int slots, int maxParticles)
+	{
+		unsigned int frameBytes, particleBytes, gridBytes, lineBytes;
+		int k, maxSegments = 2 * RENDER_SAMPLE * RENDER_SAMPLE;
+
+		close();
+		frameBytes = (sizeof(SharedFrame) + 63) & ~63;
+		particleBytes = maxParticles * sizeof(SharedParticle);
+		gridBytes = GRID_RES * GRID_RES * sizeof(float);
+		//water then ice segments, two points each
+		lineBytes = 2 * maxSegments * 2 * sizeof(Point2f);
+		bytes = 4096 + slots * (frameBytes + particleBytes + gridBytes + lineBytes);
+
+#ifdef _WIN32
+		name = regionName;
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, bytes, name.c_str());
+		if (mapping == NULL) return false;
+		base = (char *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+		if (base == NULL) {
+			CloseHandle(mapping);
+			mapping = NULL;
+			return false;
+		}
+#else
+		name = regionName[0] == '/' ? regionName : std::string("/") + regionName;
+		//a region left by a writer that crashed is dropped, not reused
+		shm_unlink(name.c_str());
+		int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+		if (fd < 0) return false;
+		if (ftruncate(fd, bytes) != 0) {
+			::close(fd);
+			return false;
+		}
+		base = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (base == (char *)MAP_FAILED) {
+			base = NULL;
+			return false;
+		}
+#endif
+
+		SharedHeader *hd = header();
+		memset(base, 0, 4096);
+		//a mapping still held open keeps its old slots; an odd seq left in
+		//one would flip the parity readers check
+		for (k = 0; k < slots; k++)
+			memset(base + 4096 + k * (frameBytes + particleBytes + gridBytes + lineBytes), 0, frameBytes);
+		hd->slots = slots;
+		hd->maxParticles = maxParticles;
+		hd->gridRes = GRID_RES;
+		hd->maxSegments = maxSegments;
+		hd->slotBytes = frameBytes + particleBytes + gridBytes + lineBytes;
+		hd->particleOffset = frameBytes;
+		hd->gridOffset = frameBytes + particleBytes;
+		hd->lineOffset = frameBytes + particleBytes + gridBytes;
+		hd->latest = -1;
+		hd->version = SHARED_VERSION;
+		SHARED_FENCE();
+		//readers check the magic last
+		hd->magic = SHARED_MAGIC;
+		frame = 0;
+		return true;
+	}
+
+	void close(void)
+	{
+		if (base == NULL) return;
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+		CloseHandle(mapping);
+		mapping = NULL;
+#else
+		munmap(base, bytes);
+		shm_unlink(name.c_str());
+#endif
+		base = NULL;
+	}
+
+	bool opened(void)
+	{
+		return base != NULL;
+	}
+
+	void publish(SPH &s)
+	{
+		int i, j, n, nWater, nIce;
+		SharedHeader *hd = header();
+		char *slot = base + 4096 + (frame % hd->slots) * hd->slotBytes;
+		SharedFrame *f = (SharedFrame *)slot;
+		SharedParticle *q = (SharedParticle *)(slot + hd->particleOffset);
+		float *grid = (float *)(slot + hd->gridOffset);
+		Point2f *line = (Point2f *)(slot + hd->lineOffset);
+
+		f->seq++;
+		SHARED_FENCE();
+
+		n = s.pNum < hd->maxParticles ? s.pNum : hd->maxParticles;
+		for (i = 0; i < n; i++) {
+			q[i].x = s.p[i].pos.x;
+			q[i].y = s.p[i].pos.y;
+			q[i].vx = s.p[i].vel.x;
+			q[i].vy = s.p[i].vel.y;
+			q[i].dens = s.p[i].dens;
+			q[i].T = s.p[i].T;
+			q[i].S = s.p[i].S;
+			q[i].phase = s.p[i].phase;
+			q[i].id = s.p[i].id;
+		}
+		for (j = 0; j < GRID_RES; j++)
+			for (i = 0; i < GRID_RES; i++)
+				grid[i + j * GRID_RES] = s.gridTemperature(i, j);
+		//segment k runs from line[2k] to line[2k + 1]
+		nWater = s.nLine0 < hd->maxSegments ? s.nLine0 : hd->maxSegments;
+		nIce = s.nLine1 < hd->maxSegments ? s.nLine1 : hd->maxSegments;
+		for (i = 0; i < nWater; i++) {
+			line[2 * i] = s.line0[i];
+			line[2 * i + 1] = s.line1[i];
+		}
+		line += 2 * nWater;
+		for (i = 0; i < nIce; i++) {
+			line[2 * i] = s.line2[i];
+			line[2 * i + 1] = s.line3[i];
+		}
+
+		f->frame = frame;
+		f->pNum = n;
+		f->nWater = nWater;
+		f->nIce = nIce;
+		f->iceFraction = s.stats.iceFraction;
+		f->totalAir = s.stats.totalAir;
+		f->maxSpeed = s.stats.maxSpeed;
+
+		SHARED_FENCE();
+		f->seq++;
+		SHARED_FENCE();
+		hd->latest = frame++;
+	}
+};
+
+// the viewer side: maps the region read-only and hands out pointers into it.
+// Data read between acquire and release is only valid if release returns
+// true; otherwise the solver overwrote the slot meanwhile and the caller
+// starts over with the new latest frame.
+class SharedStateReader
+{
+private:
+	const char *base;
+	unsigned int bytes;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+
+	const SharedHeader *header(void) { return (const SharedHeader *)base; }
+
+	const char *slot(const SharedFrame *f) { return (const char *)f; }
+
+public:
+	SharedStateReader()
+	{
+		base = NULL;
+		bytes = 0;
+#ifdef _WIN32
+		mapping = NULL;
+#endif
+	}
+
+	~SharedStateReader()
+	{
+		detach();
+	}
+
+	bool attach(const char *regionName)
+	{
+		detach();
+#ifdef _WIN32
+		mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, regionName);
+		if (mapping == NULL) return false;
+		base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (base == NULL) {
+			CloseHandle(mapping);
+			mapping = NULL;
+			return false;
+		}
+#else
+		std::string name = regionName[0] == '/' ? regionName : std::string("/") + regionName;
+		struct stat st;
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0) return false;
+		if (fstat(fd, &st) != 0 || st.st_size < 4096) {
+			::close(fd);
+			return false;
+		}
+		bytes = (unsigned int)st.st_size;
+		base = (const char *)mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (base == (const char *)MAP_FAILED) {
+			base = NULL;
+			return false;
+		}
+#endif
+		if (header()->magic != SHARED_MAGIC || header()->version != SHARED_VERSION) {
+			detach();
+			return false;
+		}
+		return true;
+	}
+
+	void detach(void)
+	{
+		if (base == NULL) return;
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+		CloseHandle(mapping);
+		mapping = NULL;
+#else
+		munmap((void *)base, bytes);
+#endif
+		base = NULL;
+	}
+
+	int latest(void)
+	{
+		return header()->latest;
+	}
+
+	// newest complete frame, or NULL before the first; seq is for release
+	const SharedFrame *acquire(unsigned int &seq)
+	{
+		const SharedHeader *hd = header();
+		const SharedFrame *f;
+		int frame;
+
+		for (;;) {
+			frame = hd->latest;
+			if (frame < 0) return NULL;
+			f = (const SharedFrame *)(base + 4096 + (frame % hd->slots) * hd->slotBytes);
+			seq = f->seq;
+			SHARED_FENCE();
+			if (!(seq & 1) && f->frame == frame) return f;
+		}
+	}
+
+	bool release(const SharedFrame *f, unsigned int seq)
+	{
+		SHARED_FENCE();
+		return f->seq == seq;
+	}
+
+	const SharedParticle *particles(const SharedFrame *f)
+	{
+		return (const SharedParticle *)(slot(f) + header()->particleOffset);
+	}
+
+	//GRID_RES x GRID_RES temperatures, x fastest
+	const float *grid(const SharedFrame *f)
+	{
+		return (const float *)(slot(f) + header()->gridOffset);
+	}
+
+	//nWater water segments, then nIce ice segments, two points each
+	const Point2f *lines(const SharedFrame *f)
+	{
+		return (const Point2f *)(slot(f) + header()->lineOffset);
+	}
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef _SOFT_RENDER_H_
+#define _SOFT_RENDER_H_
+
+#include <math.h>
+#include <vector>
+#include "const.h"
+#include "SPH.h"
+#include "bitmap.h"
+
+// draws what display() draws, on the CPU, for machines without a GL context.
+// Primitives are binned into square tiles and the tiles are filled in
+// parallel, each one drawing its primitives in submission order, so the
+// picture does not depend on the thread count. Edges get coverage based
+// anti-aliasing and are blended like GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA.
+class SoftRenderer
+{
+private:
+	//a disc, or a segment when thick > 0; all in pixels
+	struct Prim
+	{
+		float x0, y0, x1, y1;
+		float r, thick;
+		float c[3];
+	};
+
+	int w, h, tx, ty;
+	float scale;
+	std::vector<float> rgb;
+	std::vector<Prim> prim;
+	std::vector<std::vector<int> > bin;
+	std::vector<unsigned long> pixels;
+
+	void add(const Prim &q)
+	{
+		int i, j, i0, i1, j0, j1;
+		float lo, hi, pad = q.thick > 0.0f ? 0.5f * q.thick + 1.0f : q.r + 1.0f;
+
+		lo = q.x0 < q.x1 ? q.x0 : q.x1;
+		hi = q.x0 < q.x1 ? q.x1 : q.x0;
+		i0 = (int)floor((lo - pad) / SOFT_TILE);
+		i1 = (int)floor((hi + pad) / SOFT_TILE);
+		lo = q.y0 < q.y1 ? q.y0 : q.y1;
+		hi = q.y0 < q.y1 ? q.y1 : q.y0;
+		j0 = (int)floor((lo - pad) / SOFT_TILE);
+		j1 = (int)floor((hi + pad) / SOFT_TILE);
+		if (i0 < 0) i0 = 0;
+		if (j0 < 0) j0 = 0;
+		if (i1 > tx - 1) i1 = tx - 1;
+		if (j1 > ty - 1) j1 = ty - 1;
+
+		prim.push_back(q);
+		for (j = j0; j <= j1; j++)
+			for (i = i0; i <= i1; i++)
+				bin[i + j * tx].push_back((int)prim.size() - 1);
+	}
+
+	void disc(const Point2f &pos, float r, float cr, float cg, float cb)
+	{
+		Prim q;
+
+		q.x0 = q.x1 = pos.x * scale;
+		q.y0 = q.y1 = pos.y * scale;
+		q.r = r;
+		q.thick = 0.0f;
+		q.c[0] = cr;
+		q.c[1] = cg;
+		q.c[2] = cb;
+		add(q);
+	}
+
+	void segment(const Point2f &a, const Point2f &b, float thick, float cr, float cg, float cb)
+	{
+		Prim q;
+
+		q.x0 = a.x * scale;
+		q.y0 = a.y * scale;
+		q.x1 = b.x * scale;
+		q.y1 = b.y * scale;
+		q.r = 0.0f;
+		q.thick = thick;
+		q.c[0] = cr;
+		q.c[1] = cg;
+		q.c[2] = cb;
+		add(q);
+	}
+
+	//pixel coverage of a primitive at the pixel centre (px, py)
+	static float coverage(const Prim &q, float px, float py)
+	{
+		float dx, dy, ex, ey, t, len2, d;
+
+		dx = px - q.x0;
+		dy = py - q.y0;
+		if (q.thick <= 0.0f) {
+			d = sqrt(dx * dx + dy * dy);
+			d = q.r + 0.5f - d;
+		}
+		else {
+			ex = q.x1 - q.x0;
+			ey = q.y1 - q.y0;
+			len2 = ex * ex + ey * ey;
+			t = len2 > 0.0f ? (dx * ex + dy * ey) / len2 : 0.0f;
+			if (t < 0.0f) t = 0.0f;
+			else if (t > 1.0f) t = 1.0f;
+			dx -= t * ex;
+			dy -= t * ey;
+			d = 0.5f * q.thick + 0.5f - sqrt(dx * dx + dy * dy);
+		}
+		return d < 0.0f ? 0.0f : (d > 1.0f ? 1.0f : d);
+	}
+
+	//linear filtered, clamped lookup of an intensity texture, coloured as
+	//final.frag does
+	static void texel(const float *tex, const float *color, float u, float v, float *out)
+	{
+		float fx = u * RENDER_SAMPLE - 0.5f, fy = v * RENDER_SAMPLE - 0.5f;
+		int i = (int)floor(fx), j = (int)floor(fy), k, i1, j1;
+		float a = fx - i, b = fy - j, t;
+
+		i1 = i + 1;
+		j1 = j + 1;
+		if (i < 0) i = 0;
+		if (j < 0) j = 0;
+		if (i1 > RENDER_SAMPLE - 1) i1 = RENDER_SAMPLE - 1;
+		if (j1 > RENDER_SAMPLE - 1) j1 = RENDER_SAMPLE - 1;
+		if (i > RENDER_SAMPLE - 1) i = RENDER_SAMPLE - 1;
+		if (j > RENDER_SAMPLE - 1) j = RENDER_SAMPLE - 1;
+		t = (1 - a) * (1 - b) * tex[i + j * RENDER_SAMPLE] + a * (1 - b) * tex[i1 + j * RENDER_SAMPLE]
+			+ (1 - a) * b * tex[i + j1 * RENDER_SAMPLE] + a * b * tex[i1 + j1 * RENDER_SAMPLE];
+		for (k = 0; k < 3; k++)
+			out[k] += t * color[k];
+	}
+
+	void fillTile(int t, SPH &s, bool composite)
+	{
+		int i, j, k, x0, y0, x1, y1;
+		float a, *dst;
+
+		x0 = (t % tx) * SOFT_TILE;
+		y0 = (t / tx) * SOFT_TILE;
+		x1 = x0 + SOFT_TILE < w ? x0 + SOFT_TILE : w;
+		y1 = y0 + SOFT_TILE < h ? y0 + SOFT_TILE : h;
+
+		for (j = y0; j < y1; j++) {
+			for (i = x0; i < x1; i++) {
+				dst = &rgb[3 * (i + j * w)];
+				dst[0] = dst[1] = dst[2] = 0.0f;
+				if (composite) {
+					texel(s.textureWater, colorWater, (i + 0.5f) / w, (j + 0.5f) / h, dst);
+					texel(s.textureIce, colorIce, (i + 0.5f) / w, (j + 0.5f) / h, dst);
+				}
+			}
+		}
+
+		const std::vector<int> &list = bin[t];
+		for (k = 0; k < (int)list.size(); k++) {
+			const Prim &q = prim[list[k]];
+			for (j = y0; j < y1; j++) {
+				for (i = x0; i < x1; i++) {
+					a = coverage(q, i + 0.5f, j + 0.5f);
+					if (a <= 0.0f) continue;
+					dst = &rgb[3 * (i + j * w)];
+					dst[0] += a * (q.c[0] - dst[0]);
+					dst[1] += a * (q.c[1] - dst[1]);
+					dst[2] += a * (q.c[2] - dst[2]);
+				}
+			}
+		}
+	}
+
+public:
+	SoftRenderer()
+	{
+		w = h = tx = ty = 0;
+		scale = 1.0f;
+	}
+
+	// image size in pixels; the unit square fills the image as in the viewer
+	void resize(int width, int height)
+	{
+		w = width;
+		h = height;
+		tx = (w + SOFT_TILE - 1) / SOFT_TILE;
+		ty = (h + SOFT_TILE - 1) / SOFT_TILE;
+		scale = (float)(w < h ? w : h);
+		rgb.assign(3 * w * h, 0.0f);
+		bin.assign(tx * ty, std::vector<int>());
+	}
+
+	// the frame display() would show in the given render mode
+	void render(SPH &s, int mode)
+	{
+		int i, k, n;
+		float px = scale / 512.0f;
+
+		prim.clear();
+		for (i = 0; i < (int)bin.size(); i++) bin[i].clear();
+
+		if (mode == 0) {
+			for (i = 0; i < s.pNum; i++) {
+				if (s.p[i].phase == bubble)
+					disc(s.p[i].pos, 2.5f * px, 1.0f, 0.3f, 0.8f);
+				else if (s.p[i].phase == water)
+					disc(s.p[i].pos, 2.5f * px, 0.5f, 0.8f, 1.0f);
+				else
+					disc(s.p[i].pos, 2.5f * px, 0.3f, 1.0f, 0.8f);
+			}
+		}
+		else if (mode == 2) {
+			for (i = 0; i < s.nLine0; i++)
+				segment(s.line0[i], s.line1[i], 1.5f * px, 0.3f, 0.8f, 1.0f);
+			for (i = 0; i < s.nLine1; i++)
+				segment(s.line2[i], s.line3[i], 1.5f * px, 1.0f, 0.8f, 0.3f);
+		}
+		if (mode != 2) {
+			n = (int)s.bubbles.instance.size() / 3;
+			for (i = 0; i < n; i++) {
+				const float *b = &s.bubbles.instance[3 * i];
+				if (mode == 0) disc(Point2f(b[0], b[1]), b[2] * scale, 1.0f, 0.3f, 0.8f);
+				else disc(Point2f(b[0], b[1]), b[2] * scale, 1.0f, 1.0f, 1.0f);
+			}
+		}
+		for (k = 0; k < (int)s.boundary.loops.size(); k++) {
+			const std::vector<Point2f> &l = s.boundary.loops[k];
+			n = (int)l.size();
+			for (i = 0; i < n; i++)
+				segment(l[i], l[(i + 1) % n], px, 0.5f, 0.5f, 0.5f);
+		}
+
+#pragma omp parallel for schedule(dynamic, 1)
+		for (i = 0; i < tx * ty; i++)
+			fillTile(i, s, mode == 1);
+	}
+
+	// rows bottom up, like glReadPixels, so Bitmap writes it the right way up
+	bool save(const char *fileName)
+	{
+		int i, k;
+		unsigned long c[3];
+		Bitmap b;
+
+		pixels.resize(w * h);
+		for (i = 0; i < w * h; i++) {
+			for (k = 0; k < 3; k++) {
+				float v = rgb[3 * i + k];
+				c[k] = (unsigned long)((v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v)) * 255.0f + 0.5f);
+			}
+			pixels[i] = 0xff000000 | (c[2] << 16) | (c[1] << 8) | c[0];
+		}
+		b.makeBMP(&pixels[0], w, h);
+		return b.Save(fileName);
+	}
+};
+
+#endif
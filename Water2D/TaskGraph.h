@@ -0,0 +1,346 @@
+#ifndef _TASK_GRAPH_H_
+#define _TASK_GRAPH_H_
+
+#include <deque>
+#include <vector>
+#include "Thread.h"
+
+// stages of a step and what each must wait for. A stage covers [0, n) in
+// chunks of grain items, each chunk one call of fn(ctx, begin, end); chunks
+// of a stage may run at once, and a stage starts when all stages it comes
+// after are done. Stages are added after the stages they wait for, so index
+// order is always a valid serial order. A stage may carry a tag, and when
+// the graph is timed each stage sums the time its chunks take.
+class TaskGraph
+{
+public:
+	typedef void (*RangeFn)(void *ctx, int begin, int end);
+
+	struct Node
+	{
+		RangeFn fn;
+		void *ctx;
+		int n, grain, deps, tag;
+		std::vector<int> next;
+		//chunks still running and stages still awaited, during a run
+		volatile long left, waiting;
+		//microseconds spent in its chunks over all threads, when timed
+		volatile long micros;
+	};
+
+	std::vector<Node> nodes;
+	bool timed;
+
+	TaskGraph()
+	{
+		timed = false;
+	}
+
+	void clear(void)
+	{
+		nodes.clear();
+	}
+
+	int add(RangeFn fn, void *ctx, int n = 1, int grain = 1, int tag = -1)
+	{
+		Node a;
+
+		a.fn = fn;
+		a.ctx = ctx;
+		a.n = n;
+		a.grain = grain < 1 ? 1 : grain;
+		a.deps = 0;
+		a.tag = tag;
+		a.left = a.waiting = a.micros = 0;
+		nodes.push_back(a);
+		return (int)nodes.size() - 1;
+	}
+
+	void after(int node, int before)
+	{
+		nodes[before].next.push_back(node);
+		nodes[node].deps++;
+	}
+
+	int chunks(int node)
+	{
+		return (nodes[node].n + nodes[node].grain - 1) / nodes[node].grain;
+	}
+
+	// one chunk, timed if the graph is
+	void runChunk(int node, int begin, int end)
+	{
+		double t;
+		Node &a = nodes[node];
+
+		if (!timed) {
+			a.fn(a.ctx, begin, end);
+			return;
+		}
+		t = wallClock();
+		a.fn(a.ctx, begin, end);
+		atomicAdd(&a.micros, (long)((wallClock() - t) * 1e6 + 0.5));
+	}
+
+	void runSerial(void)
+	{
+		int i, b;
+
+		for (i = 0; i < (int)nodes.size(); i++) {
+			nodes[i].micros = 0;
+			for (b = 0; b < nodes[i].n; b += nodes[i].grain)
+				runChunk(i, b, b + nodes[i].grain < nodes[i].n ? b + nodes[i].grain : nodes[i].n);
+		}
+	}
+};
+
+// runs task graphs on a fixed set of workers plus the calling thread. Each
+// has its own deque: it takes its newest chunk from the back, and when
+// empty steals the oldest chunk from the front of another's, so a stage
+// spreads over idle workers while each keeps its own chunks warm. A worker
+// that finds nothing for SPINS tries sleeps until chunks are pushed or the
+// graph is done.
+class TaskScheduler
+{
+private:
+	enum { SPINS = 64 };
+
+	struct Chunk
+	{
+		int node, begin, end;
+	};
+
+	struct Queue
+	{
+		Mutex lock;
+		std::deque<Chunk> q;
+	};
+
+	struct Worker
+	{
+		TaskScheduler *s;
+		int index;
+	};
+
+	std::vector<Queue *> queues;
+	std::vector<Thread *> threads;
+	std::vector<Worker> workers;
+	TaskGraph *graph;
+	volatile long remaining;
+	Mutex idleLock;
+	Signal idle;
+	//workers asleep in the current run, and pushes so far, to wake them
+	volatile long sleepers, pushes;
+	Mutex parkLock;
+	Signal parked;
+	long generation;
+	bool quit;
+
+	static void entry(void *w)
+	{
+		((Worker *)w)->s->loop(((Worker *)w)->index);
+	}
+
+	void loop(int w)
+	{
+		long seen = 0;
+
+		for (;;) {
+			idleLock.lock();
+			while (!quit && generation == seen) idle.wait(idleLock);
+			seen = generation;
+			idleLock.unlock();
+			if (quit) break;
+			work(w);
+		}
+	}
+
+	void push(int w, int node)
+	{
+		int b, n = graph->nodes[node].n, grain = graph->nodes[node].grain;
+		Chunk c;
+
+		if (n <= 0) {
+			finish(w, node);
+			return;
+		}
+		c.node = node;
+		queues[w]->lock.lock();
+		for (b = 0; b < n; b += grain) {
+			c.begin = b;
+			c.end = b + grain < n ? b + grain : n;
+			queues[w]->q.push_back(c);
+		}
+		queues[w]->lock.unlock();
+		atomicAdd(&pushes, 1);
+		wakeSleepers();
+	}
+
+	void wakeSleepers(void)
+	{
+		if (atomicLoad(&sleepers) == 0) return;
+		parkLock.lock();
+		parked.wakeAll();
+		parkLock.unlock();
+	}
+
+	// sleeps unless chunks were pushed since seen or the run is over; both
+	// sides change their counter before reading the other's, so a push
+	// either sees the sleeper or is seen by it
+	void park(long seen)
+	{
+		parkLock.lock();
+		atomicAdd(&sleepers, 1);
+		if (atomicLoad(&pushes) == seen && atomicLoad(&remaining) > 0) parked.wait(parkLock);
+		atomicAdd(&sleepers, -1);
+		parkLock.unlock();
+	}
+
+	void finish(int w, int node)
+	{
+		int k, next;
+
+		for (k = 0; k < (int)graph->nodes[node].next.size(); k++) {
+			next = graph->nodes[node].next[k];
+			if (atomicAdd(&graph->nodes[next].waiting, -1) == 0) push(w, next);
+		}
+		if (atomicAdd(&remaining, -1) == 0) wakeSleepers();
+	}
+
+	bool take(int w, Chunk &c)
+	{
+		int k, v, n = (int)queues.size();
+		bool found = false;
+
+		queues[w]->lock.lock();
+		if (!queues[w]->q.empty()) {
+			c = queues[w]->q.back();
+			queues[w]->q.pop_back();
+			found = true;
+		}
+		queues[w]->lock.unlock();
+
+		for (k = 1; k < n && !found; k++) {
+			v = (w + k) % n;
+			queues[v]->lock.lock();
+			if (!queues[v]->q.empty()) {
+				c = queues[v]->q.front();
+				queues[v]->q.pop_front();
+				found = true;
+			}
+			queues[v]->lock.unlock();
+		}
+		return found;
+	}
+
+	void work(int w)
+	{
+		int tries = 0;
+		long seen;
+		Chunk c;
+
+		while (atomicLoad(&remaining) > 0) {
+			seen = atomicLoad(&pushes);
+			if (!take(w, c)) {
+				if (++tries < SPINS) yieldThread();
+				else {
+					park(seen);
+					tries = 0;
+				}
+				continue;
+			}
+			tries = 0;
+			graph->runChunk(c.node, c.begin, c.end);
+			//the chunk's results are seen by whoever runs the stages after it
+			memoryFence();
+			if (atomicAdd(&graph->nodes[c.node].left, -1) == 0) finish(w, c.node);
+		}
+		memoryFence();
+	}
+
+public:
+	TaskScheduler()
+	{
+		graph = NULL;
+		remaining = 0;
+		sleepers = pushes = 0;
+		generation = 0;
+		quit = false;
+		queues.push_back(new Queue);
+	}
+
+	~TaskScheduler()
+	{
+		stop();
+		delete queues[0];
+	}
+
+	// extra worker threads besides the caller of run
+	void start(int n)
+	{
+		int i;
+
+		stop();
+		quit = false;
+		workers.resize(n + 1);
+		for (i = 1; i <= n; i++) queues.push_back(new Queue);
+		for (i = 1; i <= n; i++) {
+			workers[i].s = this;
+			workers[i].index = i;
+			threads.push_back(new Thread);
+			threads.back()->start(entry, &workers[i]);
+		}
+	}
+
+	void stop(void)
+	{
+		int i;
+
+		idleLock.lock();
+		quit = true;
+		idle.wakeAll();
+		idleLock.unlock();
+		for (i = 0; i < (int)threads.size(); i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+		threads.clear();
+		for (i = 1; i < (int)queues.size(); i++) delete queues[i];
+		queues.resize(1);
+	}
+
+	int size(void)
+	{
+		return (int)queues.size();
+	}
+
+	// runs every stage of g and returns when all are done
+	void run(TaskGraph &g)
+	{
+		int i;
+
+		if (g.nodes.empty()) return;
+		graph = &g;
+		for (i = 0; i < (int)g.nodes.size(); i++) {
+			g.nodes[i].left = g.chunks(i);
+			g.nodes[i].waiting = g.nodes[i].deps;
+			g.nodes[i].micros = 0;
+		}
+		//a worker still leaving the last run may read it at any time
+		atomicAdd(&remaining, (long)g.nodes.size());
+
+		idleLock.lock();
+		generation++;
+		idle.wakeAll();
+		idleLock.unlock();
+
+		for (i = 0; i < (int)g.nodes.size(); i++)
+			if (g.nodes[i].deps == 0) push(0, i);
+		work(0);
+		//everything the stages wrote is seen by the caller
+		memoryFence();
+		graph = NULL;
+	}
+};
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#ifdef _WIN32
+//no winsock.h, so winsock2.h may still come after
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+// the few threading primitives the viewer needs, over Win32 or pthreads
+
+//adds v to *p atomically and returns the new value
+inline long atomicAdd(volatile long *p, long v)
+{
+#ifdef _WIN32
+	return InterlockedExchangeAdd(p, v) + v;
+#else
+	return __sync_add_and_fetch(p, v);
+#endif
+}
+
+//reads *p, seeing every store made before the store it reads from
+inline long atomicLoad(volatile long *p)
+{
+#ifdef _WIN32
+	long v = *p;
+
+	MemoryBarrier();
+	return v;
+#else
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void yieldThread(void)
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+inline void sleepMs(int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+//seconds since some fixed point, for measuring spans
+inline double wallClock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER t, f;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (double)t.QuadPart / (double)f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+//stores before it are seen by other threads before stores after it
+inline void memoryFence(void)
+{
+#ifdef _WIN32
+	MemoryBarrier();
+#else
+	__sync_synchronize();
+#endif
+}
+
+//a small number of the calling thread's own, handed out from 0 up
+inline long threadSlot(void)
+{
+	static volatile long next = 0;
+#ifdef _WIN32
+	static __declspec(thread) long slot = -1;
+#else
+	static __thread long slot = -1;
+#endif
+
+	if (slot < 0) slot = atomicAdd(&next, 1) - 1;
+	return slot;
+}
+
+class Mutex
+{
+private:
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t m;
+#endif
+	friend class Signal;
+
+public:
+#ifdef _WIN32
+	Mutex() { InitializeCriticalSection(&cs); }
+	~Mutex() { DeleteCriticalSection(&cs); }
+	void lock(void) { EnterCriticalSection(&cs); }
+	void unlock(void) { LeaveCriticalSection(&cs); }
+#else
+	Mutex() { pthread_mutex_init(&m, NULL); }
+	~Mutex() { pthread_mutex_destroy(&m); }
+	void lock(void) { pthread_mutex_lock(&m); }
+	void unlock(void) { pthread_mutex_unlock(&m); }
+#endif
+};
+
+// condition variable; wait must be called with the mutex locked
+class Signal
+{
+private:
+#ifdef _WIN32
+	CONDITION_VARIABLE cv;
+#else
+	pthread_cond_t cv;
+#endif
+
+public:
+#ifdef _WIN32
+	Signal() { InitializeConditionVariable(&cv); }
+	~Signal() {}
+	void wait(Mutex &m) { SleepConditionVariableCS(&cv, &m.cs, INFINITE); }
+	void wake(void) { WakeConditionVariable(&cv); }
+	void wakeAll(void) { WakeAllConditionVariable(&cv); }
+#else
+	Signal() { pthread_cond_init(&cv, NULL); }
+	~Signal() { pthread_cond_destroy(&cv); }
+	void wait(Mutex &m) { pthread_cond_wait(&cv, &m.m); }
+	void wake(void) { pthread_cond_signal(&cv); }
+	void wakeAll(void) { pthread_cond_broadcast(&cv); }
+#endif
+};
+
+class Thread
+{
+private:
+	void (*fn)(void *);
+	void *arg;
+	bool running;
+#ifdef _WIN32
+	HANDLE handle;
+
+	static DWORD WINAPI entry(LPVOID t)
+	{
+		((Thread *)t)->fn(((Thread *)t)->arg);
+		return 0;
+	}
+#else
+	pthread_t handle;
+
+	static void *entry(void *t)
+	{
+		((Thread *)t)->fn(((Thread *)t)->arg);
+		return NULL;
+	}
+#endif
+
+public:
+	Thread()
+	{
+		running = false;
+	}
+
+	~Thread()
+	{
+		join();
+	}
+
+	bool start(void (*f)(void *), void *a)
+	{
+		fn = f;
+		arg = a;
+#ifdef _WIN32
+		handle = CreateThread(NULL, 0, entry, this, 0, NULL);
+		running = handle != NULL;
+#else
+		running = pthread_create(&handle, NULL, entry, this) == 0;
+#endif
+		return running;
+	}
+
+	void join(void)
+	{
+		if (!running) return;
+#ifdef _WIN32
+		WaitForSingleObject(handle, INFINITE);
+		CloseHandle(handle);
+#else
+		pthread_join(handle, NULL);
+#endif
+		running = false;
+	}
+};
+
+#endif
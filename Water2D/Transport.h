@@ -0,0 +1,170 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#ifdef _WIN32
+#include <winsock2.h>
+#pragma comment (lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#define closesocket_t closesocket
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define closesocket_t close
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+// message passing between the processes of a distributed run; each
+// message arrives whole and in order per peer
+class Transport
+{
+public:
+	int rank, ranks;
+
+	virtual ~Transport() {}
+	virtual bool send(int peer, const void *data, int bytes) = 0;
+	virtual bool recv(int peer, std::vector<char> &data) = 0;
+};
+
+// neighbouring ranks over loopback TCP: rank r listens on basePort + r for
+// rank r + 1 and connects to rank r - 1, which is all a slab layout needs
+class SocketTransport : public Transport
+{
+private:
+	std::map<int, socket_t> peer;
+
+	static bool sendAll(socket_t s, const char *data, int bytes)
+	{
+		int n;
+
+		while (bytes > 0) {
+			n = ::send(s, data, bytes, 0);
+			if (n <= 0) return false;
+			data += n;
+			bytes -= n;
+		}
+		return true;
+	}
+
+	static bool recvAll(socket_t s, char *data, int bytes)
+	{
+		int n;
+
+		while (bytes > 0) {
+			n = ::recv(s, data, bytes, 0);
+			if (n <= 0) return false;
+			data += n;
+			bytes -= n;
+		}
+		return true;
+	}
+
+	static void noDelay(socket_t s)
+	{
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+	}
+
+	static void sleepMs(int ms)
+	{
+#ifdef _WIN32
+		Sleep(ms);
+#else
+		usleep(ms * 1000);
+#endif
+	}
+
+public:
+	SocketTransport()
+	{
+		rank = 0;
+		ranks = 1;
+	}
+
+	~SocketTransport()
+	{
+		for (std::map<int, socket_t>::iterator it = peer.begin(); it != peer.end(); ++it)
+			closesocket_t(it->second);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+
+	bool connect(int r, int n, int basePort)
+	{
+		socket_t listener = INVALID_SOCKET, s;
+		sockaddr_in addr;
+		int one = 1, tries;
+
+		rank = r;
+		ranks = n;
+#ifdef _WIN32
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+#endif
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+		if (rank < ranks - 1) {
+			listener = socket(AF_INET, SOCK_STREAM, 0);
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+			addr.sin_port = htons((unsigned short)(basePort + rank));
+			if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+				fprintf(stderr, "rank %d: cannot listen on port %d\n", rank, basePort + rank);
+				closesocket_t(listener);
+				return false;
+			}
+		}
+
+		if (rank > 0) {
+			addr.sin_port = htons((unsigned short)(basePort + rank - 1));
+			for (tries = 0; ; tries++) {
+				s = socket(AF_INET, SOCK_STREAM, 0);
+				if (::connect(s, (sockaddr *)&addr, sizeof(addr)) == 0) break;
+				closesocket_t(s);
+				if (tries == 3000) {
+					fprintf(stderr, "rank %d: rank %d did not come up\n", rank, rank - 1);
+					return false;
+				}
+				sleepMs(10);
+			}
+			noDelay(s);
+			peer[rank - 1] = s;
+		}
+
+		if (listener != INVALID_SOCKET) {
+			s = accept(listener, NULL, NULL);
+			closesocket_t(listener);
+			if (s == INVALID_SOCKET) return false;
+			noDelay(s);
+			peer[rank + 1] = s;
+		}
+		return true;
+	}
+
+	bool send(int to, const void *data, int bytes)
+	{
+		if (peer.find(to) == peer.end()) return false;
+		return sendAll(peer[to], (const char *)&bytes, sizeof(int)) && sendAll(peer[to], (const char *)data, bytes);
+	}
+
+	bool recv(int from, std::vector<char> &data)
+	{
+		int bytes;
+
+		if (peer.find(from) == peer.end()) return false;
+		if (!recvAll(peer[from], (char *)&bytes, sizeof(int))) return false;
+		data.resize(bytes);
+		return bytes == 0 || recvAll(peer[from], &data[0], bytes);
+	}
+};
+
+#endif
@@ -1,6 +1,18 @@
 #include "Water2D.h"
 #pragma comment (lib, "glew32.lib")
 
+//every particle counts for the probes
+struct AnyPhase
+{
+	bool operator()(const Particle *) const { return true; }
+};
+
+//window pixel to simulation coordinates
+Point2f toDomain(int x, int y)
+{
+	return Point2f((float)x / windowWidth, 1.0f - (float)y / windowHeight);
+}
+
 void initGL(void)
 {
 	printf("Vendor:   %s\n", glGetString(GL_VENDOR));
@@ -16,7 +28,7 @@ void initGL(void)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, RENDER_SAMPLE, RENDER_SAMPLE, 0, GL_RGBA, GL_FLOAT, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, RENDER_SAMPLE, RENDER_SAMPLE, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
 
 	//
 	glGenTextures(1, &iceTex);
@@ -25,20 +37,69 @@ void initGL(void)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, RENDER_SAMPLE, RENDER_SAMPLE, 0, GL_RGBA, GL_FLOAT, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, RENDER_SAMPLE, RENDER_SAMPLE, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
 
 	screenData = new unsigned long[windowWidth * windowHeight];
 	frameNum = 0;
 
 	glewInit();
-	if (!glewIsSupported("GL_VERSION_2_0 GL_VERSION_1_5 GL_ARB_multitexture GL_ARB_vertex_buffer_object")) {
+	if (!glewIsSupported("GL_VERSION_2_0 GL_VERSION_1_5 GL_ARB_multitexture GL_ARB_vertex_buffer_object GL_ARB_pixel_buffer_object GL_ARB_texture_rg")) {
 		fprintf(stderr, "Required OpenGL extensions missing.");
 		exit(-1);
 	}
 
+	//intensity rows are RENDER_SAMPLE bytes, not always a multiple of 4
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glGenBuffers(1, &waterPbo);
+	glGenBuffers(1, &icePbo);
+	uploadedVersion = -1;
+
 	setUpShader();
 }
 
+//stream the tiles of an intensity field that changed since the last upload
+//into its R8 texture through a pixel buffer; the buffer is orphaned first so
+//the driver never waits for the last upload. Each tile is written where it
+//sits in the full field and sent as its own sub-image
+void UploadIntensity(GLuint tex, GLuint pbo, const float *field, FieldTiles &tiles)
+{
+	int i, j, t, i0, i1, j0, j1, n = RENDER_SAMPLE * RENDER_SAMPLE, count = 0;
+	GLubyte *dst;
+
+	for (t = 0; t < tiles.tiles(); t++) count += tiles.pending[t];
+	if (count == 0) return;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, n, NULL, GL_STREAM_DRAW);
+	dst = (GLubyte *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	if (dst != NULL) {
+		for (t = 0; t < tiles.tiles(); t++) {
+			if (!tiles.pending[t]) continue;
+			tiles.bounds(t, i0, i1, j0, j1);
+			for (j = j0; j < j1; j++)
+				for (i = i0; i < i1; i++)
+					dst[i + j * RENDER_SAMPLE] = (GLubyte)(field[i + j * RENDER_SAMPLE] * 255.0f + 0.5f);
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindTexture(GL_TEXTURE_2D, tex);
+		if (count == tiles.tiles()) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_SAMPLE, RENDER_SAMPLE, GL_RED, GL_UNSIGNED_BYTE, 0);
+		}
+		else {
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, RENDER_SAMPLE);
+			for (t = 0; t < tiles.tiles(); t++) {
+				if (!tiles.pending[t]) continue;
+				tiles.bounds(t, i0, i1, j0, j1);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, i0, j0, i1 - i0, j1 - j0, GL_RED, GL_UNSIGNED_BYTE,
+					(const GLvoid *)(size_t)(i0 + j0 * RENDER_SAMPLE));
+			}
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		}
+		tiles.clearPending();
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 //set up shader
 void setUpShader()
 {
@@ -52,6 +113,19 @@ void setUpShader()
 
 	InstallShaders(programObject, vertexData, fragmentData);
 
+	//uniforms are looked up and set once, not every frame
+	waterLoc = glGetUniformLocation(programObject, "tex_water");
+	iceLoc = glGetUniformLocation(programObject, "tex_ice");
+	waterColorLoc = glGetUniformLocation(programObject, "color_water");
+	iceColorLoc = glGetUniformLocation(programObject, "color_ice");
+	if (waterLoc < 0 || iceLoc < 0 || waterColorLoc < 0 || iceColorLoc < 0)
+		printf("Uniform variables of %s not found!\n", fragmentFile);
+	glUseProgram(programObject);
+	glUniform1i(waterLoc, 0);
+	glUniform1i(iceLoc, 1);
+	glUniform4fv(waterColorLoc, 1, colorWater);
+	glUniform4fv(iceColorLoc, 1, colorIce);
+	glUseProgram(0);
 }
 
 
@@ -73,17 +147,41 @@ void initSim(void)
 
 void iteration(void)
 {
-	if (ps.pNum < PARTICLE_NUM) ps.generateParticle();
+	if (ps.pNum < ps.param.maxParticles) ps.generateParticle();
 	ps.update();
+	if (share.opened()) share.publish(ps);
+	if (recorder.opened() && simStep % recordEvery == 0) recorder.write(ps, simStep);
+
+	//a run whose density blows up is stopped, with its last metrics out first
+	StepMetrics m;
+	bool runaway = abortDensity > 0.0f && !(ps.stats.densityError < abortDensity);
+	if (metrics.opened() && (simStep % metricsEvery == 0 || runaway)) {
+		ps.measure(m);
+		metrics.write(m);
+	}
+	if (runaway) {
+		fprintf(stderr, "step %d: density error %g over %g, stopping\n", simStep, ps.stats.densityError, abortDensity);
+		exit(-1);
+	}
+	simStep++;
 }
 
+//steps and frames at their own rates, sleeping in between
 void idle(void)
 {
-	fps.update(120.0);
-	if (systemRunning) {
-		iteration();
+	int i, n;
+	bool running = systemRunning || replaying;
+
+	n = frames.simSteps(running);
+	for (i = 0; i < n; i++) {
+		if (replaying) {
+			replay.playing = systemRunning != 0;
+			replay.show(ps);
+		}
+		else iteration();
 	}
-	glutPostRedisplay();
+	if (frames.renderDue()) glutPostRedisplay();
+	else frames.wait(running);
 }
 
 void renderText(void)
@@ -99,7 +197,8 @@ void renderText(void)
 
 	char buffer[256];
 
-	sprintf_s(buffer, 256, "FPS: %.1f", fps.avgHz());
+	sprintf_s(buffer, 256, "FPS: %.1f  frame ms p50 %.1f p95 %.1f p99 %.1f", frames.avgHz(),
+		1000.0 * frames.percentile(0.5), 1000.0 * frames.percentile(0.95), 1000.0 * frames.percentile(0.99));
 	glRasterPos2i(5, 20);
 	for (char *s = buffer; *s != '\0'; s++)
 		glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *s);
@@ -110,6 +209,42 @@ void renderText(void)
 	for (char *s = buffer; *s != '\0'; s++)
 		glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *s);
 
+	if (replaying) {
+		sprintf_s(buffer, 256, "Replay frame %d/%d step %d speed %.2f ('[' ']' speed, 'R' reverse, ',' '.' step, drag to seek)",
+			replay.frame() + 1, replay.frames(), replay.step(), replay.speed);
+		glRasterPos2i(5, 80);
+		for (char *s = buffer; *s != '\0'; s++)
+			glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *s);
+	}
+
+	if (probing) {
+		SPH::FieldSample f = ps.sample(probePos);
+		int nearest;
+		float d2;
+		if (ps.nearest(probePos, 1, AnyPhase(), &nearest, &d2) > 0)
+			sprintf_s(buffer, 256, "Probe (%.3f, %.3f) density %.1f T %.2f air %.3f ice %.0f%%, nearest #%u at %.4f",
+				probePos.x, probePos.y, f.density, f.T, f.S, 100.0f * f.ice, ps.p[nearest].id, sqrt(d2));
+		else
+			sprintf_s(buffer, 256, "Probe (%.3f, %.3f) no particles", probePos.x, probePos.y);
+		glRasterPos2i(5, 100);
+		for (char *s = buffer; *s != '\0'; s++)
+			glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *s);
+	}
+
+	if (boxing) {
+		std::vector<int> inside;
+		int i, nIce = 0;
+		Point2f lo((std::min)(boxFrom.x, boxTo.x), (std::min)(boxFrom.y, boxTo.y));
+		Point2f hi((std::max)(boxFrom.x, boxTo.x), (std::max)(boxFrom.y, boxTo.y));
+		ps.inBox(lo, hi, AnyPhase(), inside);
+		for (i = 0; i < (int)inside.size(); i++)
+			if (ps.p[inside[i]].phase == ice) nIce++;
+		sprintf_s(buffer, 256, "Box %d particles, %d ice", (int)inside.size(), nIce);
+		glRasterPos2i(5, 120);
+		for (char *s = buffer; *s != '\0'; s++)
+			glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *s);
+	}
+
 	if (!systemRunning) {
 		sprintf_s(buffer, 256, "PAUSED");
 		glRasterPos2i(5, 60);
@@ -168,6 +303,8 @@ void display(void)
 		glEnd();
 		glPointSize(1.0f);
 		glDisable(GL_POINT_SMOOTH);
+		glColor3f(1.0f, 0.3f, 0.8f);
+		DrawBubbles(ps.bubbles.instance, (int)ps.bubbles.instance.size() / 3);
 		glDisable(GL_BLEND);
 	}
 	else if (ps.renderMode > 0) {
@@ -239,24 +376,17 @@ void display(void)
 
 			//glDisable(GL_BLEND);
 			//glEnable(GL_TEXTURE_2D);
+			//only fields the solver has regenerated are sent again
+			if (ps.textureVersion != uploadedVersion) {
+				UploadIntensity(waterTex, waterPbo, ps.textureWater, ps.waterTiles);
+				UploadIntensity(iceTex, icePbo, ps.textureIce, ps.iceTiles);
+				uploadedVersion = ps.textureVersion;
+			}
 			glUseProgram(programObject);
 			glActiveTexture(GL_TEXTURE0);
 			glBindTexture(GL_TEXTURE_2D, waterTex);	
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_SAMPLE, RENDER_SAMPLE, GL_RGBA, GL_FLOAT, ps.textureWater);
-			waterLoc = glGetUniformLocation(programObject, "tex_water");
-			if(waterLoc >= 0)
-				glUniform1i(waterLoc, 0);
-			else
-				printf("Uniform variable tex_water not found!\n");
-			
 			glActiveTexture(GL_TEXTURE1);
 			glBindTexture(GL_TEXTURE_2D, iceTex);
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RENDER_SAMPLE, RENDER_SAMPLE, GL_RGBA, GL_FLOAT, ps.textureIce);
-			iceLoc = glGetUniformLocation(programObject, "tex_ice");
-			if(iceLoc >= 0)
-				glUniform1i(iceLoc, 1);
-			else
-				printf("Uniform variable tex_ice not found!\n");
 
 			glEnable(GL_TEXTURE_2D);
 			glBegin(GL_QUADS);
@@ -289,31 +419,17 @@ void display(void)
 			glEnd();
 			glDisable(GL_TEXTURE_2D);*/
 
-			//glColor3f(0.3f, 0.8f, 1.0f);
 			glEnable(GL_BLEND);
-			glEnable(GL_POINT_SMOOTH);
-			glPointSize(10.0f);
-			//glBegin(GL_POINTS);
-			int i;
-			for (i = 0; i < ps.pNum; i++)
-			{
-				//
-				if(ps.p[i].phase == bubble)
-				{
-					//glPointSize(10.0f * ps.p[i].volume);
-					glColor3f(1.0f, 1.0f, 1.0f);
-					DrawCircle(ps.p[i].pos.x, ps.p[i].pos.y, 0.005 * ps.p[i].volume, 10);
-					//glVertex2fv(&ps.p[i].pos.x);
-				}
-			}
-			//glEnd();
-			glPointSize(1.0f);
-			glDisable(GL_POINT_SMOOTH);
+			glColor3f(1.0f, 1.0f, 1.0f);
+			DrawBubbles(ps.bubbles.instance, (int)ps.bubbles.instance.size() / 3);
 			glDisable(GL_BLEND);
 	}
 
 	}
 
+	DrawContainer();
+	DrawProbes();
+
 	if (systemRunning) {
 		//if (frameNum % 10 == 0)
 			//screenShot(frameNum / 10);
@@ -323,20 +439,28 @@ void display(void)
 	renderText();
 
 	glutSwapBuffers();
+	frames.presented();
 }
 
 void mouse(int button, int state, int x, int y)
 {
 	if (button == GLUT_LEFT_BUTTON) {
 		if (state == GLUT_DOWN) {
+			probing = !replaying;
+			motion(x, y);
 		}
 		else if (state == GLUT_UP) {
+			probing = false;
 		}
 	}	
 	else if (button == GLUT_RIGHT_BUTTON) {
 		if (state == GLUT_DOWN) {
+			boxing = true;
+			boxFrom = toDomain(x, y);
+			motion(x, y);
 		}
 		else if (state == GLUT_UP) {
+			boxing = false;
 		}
 	}
 	else if (button == GLUT_MIDDLE_BUTTON) {
@@ -349,6 +473,11 @@ void mouse(int button, int state, int x, int y)
 
 void motion(int x, int y)
 {
+	if (probing) probePos = toDomain(x, y);
+	if (boxing) boxTo = toDomain(x, y);
+	//scrub through a replay
+	else if (replaying) replay.seek((double)x / windowWidth * (replay.frames() - 1));
+	glutPostRedisplay();
 }
 
 void keyboard(unsigned char key, int x, int y)
@@ -372,7 +501,24 @@ void keyboard(unsigned char key, int x, int y)
 			break;
 		case 'b':
 		case 'B':
-			freeze = true;
+			ps.freeze = true;
+			break;
+		case '[':
+			replay.speed *= 0.5;
+			break;
+		case ']':
+			replay.speed *= 2.0;
+			break;
+		case 'r':
+		case 'R':
+			replay.speed = -replay.speed;
+			break;
+		case ',':
+			if (replaying) replay.seek(replay.frame() - 1);
+			break;
+		case '.':
+			if (replaying) replay.seek(replay.frame() + 1);
+			break;
 		default:
 			break;
 	}
@@ -380,6 +526,220 @@ void keyboard(unsigned char key, int x, int y)
 
 int main(int argc, char** argv)
 {
+	int i, rank = -1, ranks = 1, port = DOMAIN_PORT, steps = 1000, freezeStep = -1;
+	const char *ensembleFile = NULL, *outFile = NULL, *shareName = NULL;
+	const char *recordFile = NULL, *replayFile = NULL, *frameDir = NULL;
+	const char *eventFile = NULL, *metricsTarget = NULL;
+	int metricsFormat = METRICS_JSONL;
+	int frameEvery = 1, frameMode = 0, frameSize = SOFT_SIZE;
+	double simRate = SIM_RATE, renderRate = RENDER_RATE;
+	int taskThreads = omp_get_num_procs() - 1;
+	bool headless = false;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-benchkernels") == 0) {
+			ps.init(32);
+			ps.benchmarkKernels(stdout);
+			return 0;
+		}
+		else if (strcmp(argv[i], "-checkcores") == 0) {
+			checkCores(stdout, ps.param.kr);
+			checkSolvers(stdout, ps.param, 200);
+			return 0;
+		}
+		else if (strcmp(argv[i], "-kernels") == 0 && i + 1 < argc) {
+			ps.tabulated = strcmp(argv[++i], "table") == 0;
+		}
+		else if (strcmp(argv[i], "-params") == 0 && i + 1 < argc) {
+			if (!ps.param.load(argv[++i])) {
+				fprintf(stderr, "cannot read %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "-container") == 0 && i + 1 < argc) {
+			if (!ps.boundary.load(argv[++i])) {
+				fprintf(stderr, "cannot read %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "-ensemble") == 0 && i + 1 < argc) {
+			ensembleFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc) {
+			outFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-rank") == 0 && i + 1 < argc) {
+			rank = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-ranks") == 0 && i + 1 < argc) {
+			ranks = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-port") == 0 && i + 1 < argc) {
+			port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-steps") == 0 && i + 1 < argc) {
+			steps = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-freeze") == 0 && i + 1 < argc) {
+			freezeStep = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-share") == 0 && i + 1 < argc) {
+			shareName = argv[++i];
+		}
+		else if (strcmp(argv[i], "-headless") == 0) {
+			headless = true;
+		}
+		else if (strcmp(argv[i], "-aircontact") == 0) {
+			ps.airContact = true;
+		}
+		else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc) {
+			recordFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-events") == 0 && i + 1 < argc) {
+			eventFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc) {
+			metricsTarget = argv[++i];
+		}
+		else if (strcmp(argv[i], "-metricsformat") == 0 && i + 1 < argc) {
+			metricsFormat = strcmp(argv[++i], "prom") == 0 ? METRICS_PROMETHEUS : METRICS_JSONL;
+		}
+		else if (strcmp(argv[i], "-metricsevery") == 0 && i + 1 < argc) {
+			metricsEvery = atoi(argv[++i]);
+			if (metricsEvery < 1) metricsEvery = 1;
+		}
+		else if (strcmp(argv[i], "-abortdensity") == 0 && i + 1 < argc) {
+			abortDensity = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-recordevery") == 0 && i + 1 < argc) {
+			recordEvery = atoi(argv[++i]);
+			if (recordEvery < 1) recordEvery = 1;
+		}
+		else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) {
+			replayFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc) {
+			frameDir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-frameevery") == 0 && i + 1 < argc) {
+			frameEvery = atoi(argv[++i]);
+			if (frameEvery < 1) frameEvery = 1;
+		}
+		else if (strcmp(argv[i], "-mode") == 0 && i + 1 < argc) {
+			frameMode = atoi(argv[++i]) % 3;
+		}
+		else if (strcmp(argv[i], "-simrate") == 0 && i + 1 < argc) {
+			simRate = atof(argv[++i]);
+			if (simRate <= 0.0) simRate = SIM_RATE;
+		}
+		else if (strcmp(argv[i], "-renderrate") == 0 && i + 1 < argc) {
+			renderRate = atof(argv[++i]);
+			if (renderRate <= 0.0) renderRate = RENDER_RATE;
+		}
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+			frameSize = atoi(argv[++i]);
+			if (frameSize < 16) frameSize = 16;
+		}
+		else if (strcmp(argv[i], "-tasks") == 0 && i + 1 < argc) {
+			taskThreads = atoi(argv[++i]);
+		}
+	}
+
+	//steps of the main simulation as task graphs over the caller and
+	//-tasks extra workers; -tasks 0 keeps the plain loops
+	if (taskThreads > 0) {
+		scheduler.start(taskThreads);
+		ps.tasks = &scheduler;
+	}
+
+	if (replayFile != NULL) {
+		if (!replay.open(replayFile)) {
+			fprintf(stderr, "cannot replay %s\n", replayFile);
+			return -1;
+		}
+		ps.param = replay.param();
+		replaying = true;
+	}
+	else if (recordFile != NULL && !recorder.open(recordFile, ps.param)) {
+		fprintf(stderr, "cannot write %s\n", recordFile);
+		return -1;
+	}
+
+	//phase changes of the main simulation, written in the background
+	if (eventFile != NULL) {
+		if (!events.open(eventFile)) {
+			fprintf(stderr, "cannot write %s\n", eventFile);
+			return -1;
+		}
+		ps.events = &events;
+	}
+
+	//health of the main simulation every -metricsevery'th step, to a file
+	//or unix:path, as JSON lines or -metricsformat prom
+	if (metricsTarget != NULL) {
+		if (!metrics.open(metricsTarget, metricsFormat)) {
+			fprintf(stderr, "cannot write %s\n", metricsTarget);
+			return -1;
+		}
+		ps.timing = true;
+	}
+
+	if (shareName != NULL && !share.create(shareName, SHARED_SLOTS, ps.param.maxParticles)) {
+		fprintf(stderr, "cannot create shared state %s\n", shareName);
+		return -1;
+	}
+
+	//solver only, at full speed; viewers attach to the shared state.
+	//-steps 0 runs until killed
+	//-frames writes every -frameevery'th step as an image, drawn on the CPU
+	if (headless) {
+		SoftRenderer soft;
+		char fileName[1024];
+		soft.resize(frameSize, frameSize);
+		ps.init(32);
+		for (i = 0; steps <= 0 || i < steps; i++) {
+			if (i == freezeStep) ps.freeze = true;
+			iteration();
+			if (frameDir != NULL && i % frameEvery == 0) {
+				soft.render(ps, frameMode);
+				sprintf_s(fileName, 1024, "%s/%06d.bmp", frameDir, i / frameEvery);
+				soft.save(fileName);
+			}
+		}
+		return 0;
+	}
+
+	//one slab of a distributed run, no window
+	if (rank >= 0) {
+		SocketTransport net;
+		int total = ps.param.maxParticles;
+		if (rank >= ranks || !net.connect(rank, ranks, port)) {
+			fprintf(stderr, "rank %d of %d: cannot connect\n", rank, ranks);
+			return -1;
+		}
+		//any slab may end up holding every particle
+		ps.param.maxGhosts = total;
+		ps.init(32);
+		SlabDomain domain(&net, &ps);
+		domain.run(steps, freezeStep, total, stdout);
+		return 0;
+	}
+
+	if (ensembleFile != NULL) {
+		Ensemble ensemble;
+		FILE *out = outFile ? fopen(outFile, "wt") : stdout;
+		if (frameDir != NULL) ensemble.thumbs = frameDir;
+		ensemble.thumbMode = frameMode;
+		ensemble.container = ps.boundary;
+		if (!ensemble.load(ensembleFile) || out == NULL) {
+			fprintf(stderr, "cannot open %s\n", out == NULL ? outFile : ensembleFile);
+			return -1;
+		}
+		ensemble.run(out);
+		if (out != stdout) fclose(out);
+		return 0;
+	}
+
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
 	glutInitWindowPosition(0, 0);
@@ -396,7 +756,7 @@ int main(int argc, char** argv)
 	glutMotionFunc(motion);
 	glutKeyboardFunc(keyboard);
 
-	fps.init();
+	frames.init(simRate, renderRate);
 
 	glutMainLoop();
 
@@ -492,22 +852,79 @@ void PrintShaderCompileInfo()
 	//printf("%s\n",infolog);
 }
 
-void DrawCircle(float x1, float y1, float r, int num_segments)
+void DrawContainer(void)
 {
-	//filled circle
-	float x2,y2;
-	float angle;
+	int i, k;
 
-	glBegin(GL_TRIANGLE_FAN);
-	glColor3f(1.0f, 1.0f, 1.0f);
-	glVertex2f(x1,y1);
- 
-	for (angle=1.0f;angle<361.0f;angle+=0.2)
-	{
-		x2 = x1+sin(angle)*r;
-		y2 = y1+cos(angle)*r;
-		glVertex2f(x2,y2);
-	}
- 
-	glEnd();
-}
\ No newline at end of file
+	glColor3f(0.5f, 0.5f, 0.5f);
+	for (k = 0; k < (int)ps.boundary.loops.size(); k++) {
+		glBegin(GL_LINE_LOOP);
+		for (i = 0; i < (int)ps.boundary.loops[k].size(); i++)
+			glVertex2fv(&ps.boundary.loops[k][i].x);
+		glEnd();
+	}
+}
+
+//the box being dragged out, and the kernel radius around the probe, where
+//the fields it reads come from
+void DrawProbes(void)
+{
+	int k;
+
+	glColor3f(1.0f, 1.0f, 0.3f);
+	if (boxing) {
+		glBegin(GL_LINE_LOOP);
+		glVertex2f(boxFrom.x, boxFrom.y);
+		glVertex2f(boxTo.x, boxFrom.y);
+		glVertex2f(boxTo.x, boxTo.y);
+		glVertex2f(boxFrom.x, boxTo.y);
+		glEnd();
+	}
+	if (probing) {
+		glBegin(GL_LINE_LOOP);
+		for (k = 0; k < BUBBLE_SEGMENTS; k++)
+			glVertex2f(probePos.x + ps.param.kr * cos((float)k / BUBBLE_SEGMENTS * D360),
+				probePos.y + ps.param.kr * sin((float)k / BUBBLE_SEGMENTS * D360));
+		glEnd();
+	}
+}
+
+//bubbles as x, y, radius instances, all drawn from one vertex array
+void DrawBubbles(const std::vector<float> &instance, int n)
+{
+	static float unit[BUBBLE_SEGMENTS + 1][2];
+	static std::vector<float> vertex;
+	static bool ready = false;
+	int i, k;
+	float x, y, r, *v;
+
+	if (!ready) {
+		for (k = 0; k <= BUBBLE_SEGMENTS; k++) {
+			unit[k][0] = cos((float)k / BUBBLE_SEGMENTS * D360);
+			unit[k][1] = sin((float)k / BUBBLE_SEGMENTS * D360);
+		}
+		ready = true;
+	}
+	if (n == 0) return;
+
+	vertex.resize(n * BUBBLE_SEGMENTS * 6);
+	v = &vertex[0];
+	for (i = 0; i < n; i++) {
+		x = instance[3 * i];
+		y = instance[3 * i + 1];
+		r = instance[3 * i + 2];
+		for (k = 0; k < BUBBLE_SEGMENTS; k++) {
+			*v++ = x;
+			*v++ = y;
+			*v++ = x + r * unit[k][0];
+			*v++ = y + r * unit[k][1];
+			*v++ = x + r * unit[k + 1][0];
+			*v++ = y + r * unit[k + 1][1];
+		}
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, &vertex[0]);
+	glDrawArrays(GL_TRIANGLES, 0, n * BUBBLE_SEGMENTS * 3);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
@@ -1,12 +1,23 @@
+//winsock2.h must come before windows.h
+#include "Domain.h"
+#include <windows.h>
+#include "SharedState.h"
+#include "Recording.h"
+#include "EventLog.h"
+#include "Metrics.h"
+#include "Replay.h"
+#include "SoftRender.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <gl\glew.h>
 #include <gl\glut.h>
 #include "const.h"
 #include "SPH.h"
+#include "Ensemble.h"
 #include "Point.h"
-#include "Timer.h"
+#include "FrameScheduler.h"
 #include "bitmap.h"
 #include <gl\GLAux.h>
 
@@ -15,9 +26,22 @@ int windowWidth = 512, windowHeight = 512;
 
 int systemRunning = 0;
 int testSwitch = 0;
-Timer fps;
+FrameScheduler frames;
 
 SPH ps;
+TaskScheduler scheduler;
+SharedStateWriter share;
+Recorder recorder;
+EventLog events;
+int recordEvery = 1, simStep = 0;
+MetricsExporter metrics;
+int metricsEvery = 1;
+float abortDensity = 0.0f;
+//left drag probes the fields at a point, right drag counts a box
+bool probing = false, boxing = false;
+Point2f probePos, boxFrom, boxTo;
+Replay replay;
+bool replaying = false;
 GLuint waterTex, iceTex, finalTex;
 
 unsigned long *screenData;
@@ -35,10 +59,18 @@ GLuint fragementShaderObject;
 GLuint programObject;
 GLint waterLoc;
 GLint iceLoc;
+GLint waterColorLoc;
+GLint iceColorLoc;
+GLuint waterPbo, icePbo;
+int uploadedVersion;
 
 int ShaderSize(const char *fileName );
 GLchar* ReadShaderSource(const char *fileName, int len);
 int InstallShaders( GLuint &programObj,GLchar *Vertex, GLchar *Fragement );
 void PrintShaderCompileInfo();
 void setUpShader();
-void DrawCircle(float cx, float cy, float r, int num_segments);
\ No newline at end of file
+void UploadIntensity(GLuint tex, GLuint pbo, const float *field, FieldTiles &tiles);
+void DrawContainer(void);
+void DrawProbes(void);
+void DrawBubbles(const std::vector<float> &instance, int n);
+void motion(int x, int y);
\ No newline at end of file
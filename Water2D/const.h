@@ -4,6 +4,7 @@
 #define EPS 1e-12f
 #define PI 3.14159265358979323846
 #define D360 6.28318530717958647693
+#define GOLDEN_ANGLE 2.39996322972865332f
 #define PI_180 0.01745329251994329577
 
 #define TIME_STEP 0.01f
@@ -15,22 +16,52 @@
 #define GAS_CONSTANT 2.0f
 #define VISCOSITY 0.02f
 #define ELASTICITY 0.618f
+#define BOUNDARY_RES 256
+#define BOUNDARY_FIELD_RES 128
+#define WALL_STIFFNESS 500.0f
+//wall pressure layer, in kernel radii
+#define WALL_LAYER 0.25f
+#define WALL_MARGIN 1e-4f
+#define AIR_LAYER 0.01f
 #define RENDER_SAMPLE 100//128
+//texels per side of a field tile that is redrawn and uploaded on its own
+#define RENDER_TILE 10
+#define KERNEL_TABLE_SIZE 1024
+
+#define BUBBLE_THRESHOLD 1.3f
+#define BUBBLE_RADIUS 0.0057f
+#define BUBBLE_BUOYANCY 2.0f
+#define BUBBLE_DRAG 0.9f
+#define BUBBLE_HASH_MAX 64
+#define BUBBLE_SEGMENTS 12
+//steps between slab rebalancing, first port of a distributed run
+#define DOMAIN_REBALANCE 10
+#define DOMAIN_PORT 27600
+//frames in the shared state ring
+#define SHARED_SLOTS 4
+//pixels per side of a software renderer tile, default image size
+#define SOFT_TILE 32
+#define SOFT_SIZE 512
+//viewer pacing: steps and frames per second, early wake before spinning
+#define SIM_RATE 120.0
+#define RENDER_RATE 60.0
+#define SLEEP_MARGIN 0.002
+#define FRAME_HISTORY 240
+//particles per task of a scheduled step
+#define TASK_GRAIN 256
+//cells per task of the neighbour loops, particles per tile of their pairs
+#define CELL_GRAIN 8
+#define PAIR_TILE 64
+//steps between sorts of the particles by cell
+#define SORT_EVERY 16
+//phase change log: rings, events per ring (a power of 2), writer period in ms
+#define EVENT_RINGS 64
+#define EVENT_RING 1024
+#define EVENT_FLUSH_MS 20
 
 #define SQ(x) ((x) * (x))
 #define CUBE(x) ((x) * (x) * (x))
 
-const float KR2 = SQ(KR);
-const float KR3 = KR2 * KR;
-const float KR4 = SQ(KR2);
-const float KR6 = SQ(KR3);
-const float KR9 = KR6 * KR3;
-
-float WPoly6Scale;
-float WSpikyScale;
-float WViscosityScale;
-float WLucyScale;
-
 enum status {water, ice, bubble};
 
 //thermal diffusion constant
@@ -41,10 +72,14 @@ const float Tair = -20.0f;
 const float Tfreeze = 0.0f;
 const float Twater = 20.0f;
 
-bool print;
-bool freeze;
-bool gridBuilt;
 const float gridSize = 0.02f;
+#define GRID_RES 50
+//share of the grid's temperature change a particle takes on top of its own
+//temperature, the rest being the grid's temperature (FLIP against PIC)
+#define HEAT_FLIP 0.95f
+//particle conduction diffusivity per unit of cThermal; kept below
+//1 / (cThermalIce * TIME_STEP * sum of the Laplacian kernel) to stay stable
+#define CONDUCTIVITY 0.01f
 
 float colorWater[4] = { 0.3, 0.5, 0.6, 1.0};
 float colorIce[4] = { 0.3, 0.5, 0.9, 1.0};
@@ -4,19 +4,22 @@
 
 out vec4 vFragColor;
 
+//single channel intensities, coloured here
 uniform sampler2D tex_water;
 uniform sampler2D tex_ice;
+uniform vec4 color_water;
+uniform vec4 color_ice;
 
 void main(void)
 { 
 	vec4 color = vec4(0, 0, 0, 0);
 	vec4 color_interface = vec4( 0.3, 0.5, 0.6, 1.0);
-	vec4 color_water = texture2D(tex_water, gl_TexCoord[0].st);
-	vec4 color_ice = texture2D(tex_ice, gl_TexCoord[0].st);
-	//if(color_water != color && color_ice != color)
+	float water = texture2D(tex_water, gl_TexCoord[0].st).r;
+	float ice = texture2D(tex_ice, gl_TexCoord[0].st).r;
+	//if(water > 0.0 && ice > 0.0)
 	//	vFragColor = color_interface;
 	//else
-		vFragColor = texture2D(tex_water, gl_TexCoord[0].st) + texture2D(tex_ice, gl_TexCoord[0].st);
+		vFragColor = water * color_water + ice * color_ice;
    // + texture2D(tex_ice, gl_TexCoord[0].st);
     //vFragColor = color;
 }
@@ -6,16 +6,14 @@
 struct Particle {
 	Point2f pos, vel, acc;
 	float dens, pressure;
-	Particle *next;
+	//stays with the particle wherever it is moved in the array
+	unsigned int id;
 	//status
 	status phase;
-	//temperature
-	float T;
+	//temperature, and its rate from conduction
+	float T, dT;
 	//dissolved air
 	float S;
-
-	float volume;
-
 };
 
 #endif
\ No newline at end of file
@@ -1,9 +1,9 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
-double linearInterpolation(double x1, double f_x1, double x2, double f_x2, double x);
+float linearInterpolation(float x1, float f_x1, float x2, float f_x2, float x);
 
-double bilinearInterpolation(double x1, double f_x1, double g_x1, double x2, double f_x2, 
-	double g_x2, double x, double y1, double y2, double y);
+float bilinearInterpolation(float x1, float f_x1, float g_x1, float x2, float f_x2,
+	float g_x2, float x, float y1, float y2, float y);
 
 #endif
\ No newline at end of file